@@ -25,8 +25,10 @@
 // -----------------------------------------------------------------------------
 //
 // To compile (debug or optimized):
-// g++ -Wall -o funcsamp2D funcsamp2D.cpp
-// g++ -O3 -o funcsamp2D funcsamp2D.cpp
+// g++ -Wall -pthread -o funcsamp2D funcsamp2D.cpp -ldl
+// g++ -O3 -fno-math-errno -fno-trapping-math -pthread -o funcsamp2D funcsamp2D.cpp -ldl
+// (These two flags do not change any results, but let the loops with sqrt and with
+// selects between floating-point values vectorize.)
 //
 // To run:
 // funcsamp2D functionName samplesFilename [numSamples numSequences]
@@ -69,8 +71,139 @@
 //   1020 0.012088
 //   1024 0.012021
 //
+// The sequences are evaluated in parallel, and the table is the same for any number of
+// threads.
+//
 // These errors can then be plotted with a plotting program such as Gnuplot or similar.
 //
+// Instead of a function name, the following modes can be given:
+//
+// funcsamp2D discrepancy samplesFilename [numSamples numSequences]
+//   Prints the average L2-star discrepancy and a lower and upper bound on the L-infinity
+//   star discrepancy of the sequences for sample counts 4, 8, 12, ... numSamples.
+//   The sequences are processed in parallel.
+//
+// funcsamp2D spectrum samplesFilename [numSamples numSequences]
+//   Computes the power spectrum (periodogram) of the first 16, 32, 64, ... numSamples points
+//   of each sequence, averaged over the sequences, and writes it as a PFM image and a
+//   radially averaged profile for each of these sample counts.
+//
+// funcsamp2D --cache functionName samplesFilename [numSamples numSequences]
+//   Stores the function values at all sample points in samplesFilename.<key>.values (as
+//   floats), or reads them from there if the file exists, in which case the sample file is
+//   not parsed and the function is not evaluated.  The key is a hash of the sample file, the
+//   function and the parameters.  Works for named functions, --image, --expr and --plugin,
+//   and with --copies, --subranges and --adaptive.
+//
+// funcsamp2D --checkpoint file [--checkpoint-every s] [--resume] functionName samplesFilename ...
+//   Writes the state of the run (running sums of all trials and the errors so far) to the
+//   file every s seconds (default 60).  With --resume a run continues from the state in the
+//   file if it exists, after printing the errors from before the checkpoint again.  The file
+//   is removed at the end of the run.  For the main error table only.
+//
+// funcsamp2D --sequence-range a:b --partial file functionName samplesFilename [numSamples numSequences]
+// funcsamp2D merge file1 file2 ...
+//   Uses only sequences a .. b-1 and writes their error sums to a binary partial result file.
+//   merge adds the partial result files of sequence ranges that together cover all sequences
+//   and prints exactly the error table of a single --partial run over all sequences.  Runs
+//   with --sequence-range or --partial add the errors in fixed point so that the shards add
+//   up exactly; a plain run adds them as doubles, which can differ in the last digit.
+//
+// funcsamp2D --numa ...
+//   Pins the worker threads to CPUs grouped by NUMA node, gives each thread a fixed block of
+//   sequences (for the main error table: fixed runs of trials), and has each thread first
+//   touch the sample table rows it evaluates so they are allocated on its node (Linux).  Not
+//   for --pair, --adaptive, verify and bench, which do not split the sequences that way.
+//
+// funcsamp2D --no-hugepages ...
+//   The sample tables and other large arrays are normally backed by 2 MB huge pages (explicit
+//   hugetlbfs pages if reserved, else transparent huge pages) to save TLB misses; this option
+//   uses ordinary 4 KB pages instead, for comparison.
+//
+// funcsamp2D --fastmath accurate|fast functionName samplesFilename [numSamples numSequences]
+//   Evaluates exp and sin in the Gaussian and sine functions with polynomials that vectorize
+//   instead of libm calls.  "accurate" has errors below 1e-15, "fast" below 1e-9; for
+//   sininvr the errors are below 1e-15 (1 + pi/r) and 1e-9 (1 + pi/r).
+//
+// funcsamp2D [--repeats n] bench samplesFilename [numSamples numSequences]
+//   Times the stages of a run: parsing the sample file, gathering the points into arrays,
+//   reading them from the sample table in the strided order of the main loop, evaluating
+//   each function at the gathered points one point at a time and in batches, and writing
+//   the error table.  Prints one line per stage with the median and minimum time over n repeats
+//   (default 5) and the points (or lines) per second.
+//
+// funcsamp2D verify samplesFilename [numSamples numSequences]
+//   Checks that the branchless versions of triangleramp, stepx and rampx, which are used by
+//   default, give bit-identical results to the original versions (used with --branchy) at
+//   the sample points, on a grid and next to the edges of the pieces, and that the --fastmath
+//   polynomials are within their error bounds.  Exits with status 1 if not.
+//
+// funcsamp2D [--instances n] [--seed n] randomdisks samplesFilename [numSamples numSequences]
+//   Like a function name, but each sequence integrates n random disks (default 1000) and the
+//   error is averaged over all of them.  The other randomized families are randomhalfplanes
+//   and randomgaussians (with random anisotropic widths).
+//
+// funcsamp2D --image file.pfm [--filter nearest|bilinear] samplesFilename [numSamples numSequences]
+//   Integrates a PFM image (with y = 0 at the first row in the file) instead of a named
+//   function.  The reference value is the exact integral of the filtered image.
+//
+// funcsamp2D --expr "exp(-x*x-4*y*y)" samplesFilename [numSamples numSequences]
+//   Integrates an expression in x and y instead of a named function.  The reference value
+//   is computed by numerical integration of the expression.  With --jit the expression is
+//   compiled to native code with the system C compiler (or $CC) before the run.
+//
+// funcsamp2D --subranges k functionName samplesFilename [numSamples numSequences]
+//   Prints the error of samples [offset, offset+N) for offsets 0, k, 2k, ... and sample
+//   counts N = 4, 8, 12, ... numSamples-offset, as lines with offset, N and error.  The
+//   function is evaluated once per sample point; the estimates come from prefix sums.
+//   --subranges also works with --image, --expr and --plugin.
+//
+// funcsamp2D --adaptive tol functionName samplesFilename [numSamples numSequences]
+//   Evaluates the sequences in batches and stops when the standard error of the average
+//   error is at most tol times the average error at every sample count (for example 0.05),
+//   so numSequences is only an upper limit.  The first output line is a comment with the
+//   number of trials used.
+//
+// funcsamp2D --fit lo:hi[,lo:hi...] functionName samplesFilename [numSamples numSequences]
+//   After the error table, prints a comment line with the least-squares slope of log(error)
+//   against log(N) for sample counts N in each range, with a 95% confidence interval and the
+//   constant c in error = c N^slope.  Works with all modes that print an error table.
+//
+// funcsamp2D --copies k [--shift cp|xor|owen] functionName samplesFilename [numSamples numSequences]
+//   Uses k randomly shifted copies of each sequence as separate trials, so the errors are
+//   averaged over k * numSequences trials.  The shift is a toroidal (Cranley-Patterson)
+//   shift or a digital shift (xor of the 32-bit fixed-point coordinates).  The shifted
+//   points are computed on the fly.  --copies also works with --subranges and the random
+//   integrand families.  --shift owen applies base-2 Owen scrambling instead.
+//
+// funcsamp2D functionName owen-sobol [numSamples numTrials]
+// funcsamp2D functionName owen-halton [numSamples numTrials]
+//   Instead of reading a sample file, generates Owen-scrambled Sobol (dimensions 0 and 1)
+//   or Halton (bases 2 and 3) points on the fly, with a different scrambling for each trial
+//   (set with --seed).  There is no limit on the number of trials.  --shift owen similarly
+//   rescrambles the points of a sample file for each --copies trial.
+//
+// funcsamp2D --pair samplesFilename2 function4D samplesFilename [numSamples numSequences]
+//   Zips the points of two sample files (or generators) into 4D points and integrates a
+//   4D function: f*g (product of two named functions of (x0,x1) and (x2,x3)), cross:f*g
+//   (product of functions of (x0,x2) and (x1,x3)), ball4D or simplex4D.
+//
+// funcsamp2D --dim d functionND samplesFilename [numSamples numSequences]
+//   Reads a sample file with d coordinates per sample and integrates one of the
+//   d-dimensional functions ballND, gaussianND, simplexND, sinND and quadraticND (which
+//   can also be used without --dim, in 2D).  The error tables and the options for them
+//   (--copies, --cache, --checkpoint, --sequence-range, --partial, --subranges, --adaptive,
+//   --fastmath, --numa, ...) are the same as in 2D.
+//
+// funcsamp2D --perf functionName samplesFilename [numSamples numSequences]
+//   Also prints the cycles, instructions, last-level cache misses and branch misses of the
+//   parse and evaluation phases, the IPC and the misses per sample point on stderr.  Uses
+//   the Linux perf_event_open system call (perf_event_paranoid must allow user-space counting).
+//
+// funcsamp2D --plugin file.so samplesFilename [numSamples numSequences]
+//   Integrates a function defined in a plugin shared object instead of a named function.
+//   See funcsamp2D_plugin.h for the plugin interface.
+//
 // Feel free to modify this program in any way you want!
 //
 
@@ -79,7 +212,26 @@
 #include <stdio.h>
 #include <math.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
 #include <assert.h>
+#include <limits.h>
+#include <dlfcn.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <type_traits>
+
+#include "funcsamp2D_plugin.h"
 
 
 #define MIN(a,b) ((a < b) ? (a) : (b))
@@ -88,11 +240,16 @@
 #define MAXSAMPLES 4096
 #define MAXTABLES 10000
 #define NUMFUNCTIONS 18
+#define OUTPUTINTERVAL 4   // errors are printed for every 4th sample count
+#define EVALBATCH 256      // number of points the function is evaluated at in one call
 
 typedef struct Point { double x, y; } Point;
 
 
-Point samplePoints[MAXTABLES][MAXSAMPLES];   // sample points read from file
+// Sample tables, allocated from the arena with one row per sequence
+Point (*samplePoints)[MAXSAMPLES] = NULL;   // sample points read from file
+
+int numThreads = 1;   // number of worker threads (set in main)
 
 // Known functions and their reference values:
 typedef struct Functions {
@@ -336,142 +493,4699 @@ sin2x(double x)
 }
 
 
-// Random value between 0 and 1
+//
+// Branchless versions of the piecewise functions.
+//
+// For well-distributed samples the branches in the piecewise functions are unpredictable.
+// These versions compute every piece and select the result with comparisons (MIN, MAX and
+// ?: on values that are already computed), which the compiler turns into min/max/blend
+// instructions, so the batch loops vectorize.  They return bit-identical results to the
+// functions above (checked with "funcsamp2D verify"), and are used for batch evaluation
+// unless --branchy is given.  Only the functions where this measurably wins in "funcsamp2D
+// bench" have a branchless version: the compiler already if-converts the disks and the
+// triangle, and the disk ramps and sininvr are faster as they are.  Batch times for 1024 x
+// 100 points, branchless vs branchy, with the -fno-math-errno -fno-trapping-math build and
+// with plain -O3:
+//   triangleramp   0.27 ms vs 0.30 ms    0.21 ms vs 1.26 ms
+//   stepx          0.13 ms vs 0.14 ms    0.12 ms vs 0.12 ms
+//   rampx          0.29 ms vs 0.30 ms    0.21 ms vs 0.49 ms
+//
+
+bool branchyIntegrands = false;   // use the original functions for batch evaluation
+
+
+// 1 - (r - innerRadius) / (outerRadius - innerRadius) clamped to [0,1].  The quotient is 1
+// exactly at r = outerRadius, so the clamped ramp equals the if/else version everywhere.
+static inline double
+rampBranchless(double r, double innerRadius, double outerRadius)
+{
+    double v = 1.0 - (r - innerRadius) / (outerRadius - innerRadius);
+    v = MIN(v, 1.0);
+    return MAX(v, 0.0);
+}
+
+
+// 5 (y - x) + 0.5 clamped to [0,1]; the clamped ends are exactly -0.5 + 0.5 and 0.5 + 0.5
 double
-uniformrandom()
+trianglerampBranchless(double x, double y)
 {
-    return drand48();
+    double v = 5.0 * (y - x) + 0.5;
+    v = MIN(v, 1.0);
+    return MAX(v, 0.0);
 }
 
 
-// Evaluate function at sample point s from table t
 double
-evaluateFunction(int functionNum, int t, int s)
+stepBranchless(double x)
 {
-    Point sample;
-    double result = 0.0;
+    return (double) (x < 1.0/M_PI);
+}
+
+
+double
+rampxBranchless(double x)
+{
+    return rampBranchless(x, 0.2, 0.4);
+}
+
+
+//
+// Polynomial exp and sin for the smooth functions.
+//
+// With --fastmath the batch loops of the functions with exp and sin use Horner-evaluated
+// polynomials instead of libm calls, so they vectorize.  The polynomials are specialized for
+// the arguments the functions see for points in the unit square:
+//   exp(x) for -2 <= x <= 0 (the Gaussians) is reduced to 2^k exp(r) with integer k and
+//   |r| <= ln(2)/2, with the 2^k made from the exponent bits, and exp(r) is evaluated with
+//   the Taylor polynomial of e^r.
+//   sin(pi u) for any u (sinxy, sininvr, siny, sin2x) is reduced with selects to
+//   sin(pi w) with |w| <= 1/2, then evaluated with the odd Taylor polynomial of sin.
+// The accuracy tier sets the degrees: "accurate" has an absolute error below 1e-15 and
+// "fast" below 1e-9 (checked by "funcsamp2D verify"), both far below the sampling errors.
+// The exception is sininvr = sin(pi/r): the rounding of pi/r already changes the result by
+// about 1e-16 pi/r, so there the bounds hold for the error divided by 1 + pi/r, and the
+// absolute error grows without bound towards the origin (about 1e-13 for the "accurate"
+// tier at the points of the usual sample files).
+// sqrt is not replaced: with -fno-math-errno it is a (vectorized) sqrt instruction.
+//
+
+enum MathTier { MATHLIBM, MATHACCURATE, MATHFAST };
+
+int mathTier = MATHLIBM;
+
+#define EXPDEGREEACCURATE 12   // max error 2e-16 for -2 <= x <= 0
+#define EXPDEGREEFAST 8        // max error 2e-10
+#define SINTERMSACCURATE 11    // max error 3e-16
+#define SINTERMSFAST 7         // max error 7e-10
+
+// 1/k!
+const double inverseFactorial[24] = {
+    1.0, 1.0, 0.5, 0.16666666666666666, 0.041666666666666664, 0.008333333333333333,
+    0.001388888888888889, 0.0001984126984126984, 2.48015873015873e-05,
+    2.7557319223985893e-06, 2.755731922398589e-07, 2.505210838544172e-08,
+    2.08767569878681e-09, 1.6059043836821613e-10, 1.1470745597729725e-11,
+    7.647163731819816e-13, 4.779477332387385e-14, 2.8114572543455206e-15,
+    1.5619206968586225e-16, 8.22063524662433e-18, 4.110317623312165e-19,
+    1.9572941063391263e-20, 8.896791392450574e-22, 3.8681701706306835e-23
+};
+
+
+// exp(x) for -2 <= x <= 0 (and down to x = -700)
+template <int Degree>
+static inline double
+expPoly(double x)
+{
+    const double roundMagic = 6755399441055744.0;   // 1.5 * 2^52: adding it rounds to integer
+    const double ln2High = 0.6931471803691238, ln2Low = 1.9082149292705877e-10;
+    // x = k ln(2) + r; ln(2) is split in two parts so that k ln2High is exact
+    double kRounded = x * 1.4426950408889634 + roundMagic;
+    double k = kRounded - roundMagic;
+    double r = (x - k * ln2High) - k * ln2Low;
+    double p = inverseFactorial[Degree];
+    for (int j = Degree - 1; j >= 0; j--)
+        p = p * r + inverseFactorial[j];
+    // The low bits of kRounded hold k; moved into the exponent field they give 2^k
+    unsigned long long bits, magicBits;
+    memcpy(&bits, &kRounded, sizeof(bits));
+    memcpy(&magicBits, &roundMagic, sizeof(magicBits));
+    bits = (bits - magicBits + 1023) << 52;
+    double scale;
+    memcpy(&scale, &bits, sizeof(scale));
+    return p * scale;
+}
+
+
+// sin(pi u) for |u| < 2^50
+template <int Terms>
+static inline double
+sinPiPoly(double u)
+{
+    const double roundMagic = 6755399441055744.0;   // 1.5 * 2^52: adding it rounds to integer
+    // v = u - 2 round(u/2) is in [-1,1], and sin(pi |v|) = sin(pi (1 - |v|))
+    double half = 0.5 * u;
+    double v = u - 2.0 * ((half + roundMagic) - roundMagic);
+    double a = fabs(v), b = 1.0 - a;
+    double w = copysign(MIN(a, b), v);
+    const double z = M_PI * w, z2 = z * z;
+    double p = (Terms % 2) ? inverseFactorial[2*Terms - 1] : -inverseFactorial[2*Terms - 1];
+    for (int j = Terms - 2; j >= 0; j--)
+        p = p * z2 + ((j % 2) ? -inverseFactorial[2*j + 1] : inverseFactorial[2*j + 1]);
+    return p * z;
+}
+
 
-    sample = samplePoints[t][s];
+// Evaluate the functions with exp and sin at n points with the polynomials.  Returns false
+// for the other functions.
+template <int ExpDegree, int SinTerms>
+static bool
+evaluateFastMathBatch(int functionNum, const double* __restrict x, const double* __restrict y,
+                      double* __restrict out, int n)
+{
+    int k;
 
     switch (functionNum) {
-    // 2D:
-    case 0: result = quarterdisk(sample.x, sample.y); break;
-    case 1: result = fulldisk(sample.x, sample.y); break;
-    case 2: result = triangle(sample.x, sample.y); break;
-    case 3: result = quarterdiskramp(sample.x, sample.y); break;
-    case 4: result = fulldiskramp(sample.x, sample.y); break;
-    case 5: result = triangleramp(sample.x, sample.y); break;
-    case 6: result = quartergaussian2D(sample.x, sample.y); break;
-    case 7: result = fullgaussian2D(sample.x, sample.y); break;
-    case 8: result = bilinear(sample.x, sample.y); break;
-    case 9: result = biquadratic(sample.x, sample.y); break;
-    case 10: result = sinxy(sample.x, sample.y); break;
-    case 11: result = sininvr(sample.x, sample.y); break;
-    // 1D:
-    case 12: result = step(sample.x); break;
-    case 13: result = ramp(sample.x); break;
-    case 14: result = linear(sample.y); break;
-    case 15: result = gaussian1D(sample.x); break;
-    case 16: result = sinx(sample.y); break;
-    case 17: result = sin2x(sample.x); break;
+    case 6:
+        for (k = 0; k < n; k++) out[k] = expPoly<ExpDegree>(-x[k]*x[k] - y[k]*y[k]);
+        return true;
+    case 7:
+        for (k = 0; k < n; k++) {
+            double dx = x[k] - 0.5, dy = y[k] - 0.5;
+            out[k] = expPoly<ExpDegree>(-dx*dx - dy*dy);
+        }
+        return true;
+    case 10:
+        for (k = 0; k < n; k++) out[k] = sinPiPoly<SinTerms>(x[k] + y[k]);
+        return true;
+    case 11:
+        for (k = 0; k < n; k++) {
+            double r = sqrt(x[k]*x[k] + y[k]*y[k]);
+            double safeR = (r > 0.0) ? r : 1.0;
+            double v = sinPiPoly<SinTerms>(1.0 / safeR);
+            out[k] = (r > 0.0) ? v : 1.0;
+        }
+        return true;
+    case 15:
+        for (k = 0; k < n; k++) out[k] = expPoly<ExpDegree>(-x[k]*x[k]);
+        return true;
+    case 16:
+        for (k = 0; k < n; k++) out[k] = sinPiPoly<SinTerms>(y[k]);
+        return true;
+    case 17:
+        for (k = 0; k < n; k++) out[k] = sinPiPoly<SinTerms>(2.0 * x[k]);
+        return true;
     }
+    return false;
+}
 
-    return result;
+
+// Random value between 0 and 1
+double
+uniformrandom()
+{
+    return drand48();
 }
 
 
-int
-main(int argc, char *argv[]) {
-    FILE *fd;
-    double* sumresults;
-    double reference, result, estimate, error, sumerror, aveerror, maxerror;
-    double x, y;
-    int functionNumber;
-    int numSamples = 1024, numSequences = 100;
-    int s, t, i;
-    int ok, line;
-    char *functionName = NULL, *samplesFilename = NULL;
+//
+// Image integrands.
+//
+// A PFM image covering the unit square (row 0 at y = 0, as stored in PFM files) is looked up
+// with nearest-neighbor or bilinear filtering.  For cache locality the texels are stored in
+// tiles of 8x8 texels, with the texels in a tile in Morton order, so the texels of a bilinear
+// footprint and of nearby samples are mostly in the same cache lines.  The reference value is
+// the image average, read from a summed-area table of the image; with clamp-to-edge
+// addressing bilinear filtering has the same integral as nearest-neighbor filtering.
+//
 
-    if (argc < 3 || argc > 5) {
-	printf("Usage: funcsamp2D functionName samplesFilename [numSamples numSequences]\n");
-	return 1;
-    }
+#define IMAGEFUNCTION NUMFUNCTIONS   // function number used for the image integrand
+#define IMAGETILELOG2 3              // tiles of 8x8 texels
 
-    // Find function name in table of known functions
-    functionName = argv[1];
-    bool match = false;
-    for (i = 0; i < NUMFUNCTIONS; i++) {
-        match = (strcmp(functionName, functionTable[i].name) == 0);
-        if (match) break;
+typedef struct Image {
+    int width, height;
+    int tilesX;          // number of tiles per row
+    float* texels;       // tiled and Morton-ordered copy of the image
+    bool bilinear;
+    double refValue;
+} Image;
+
+Image integrandImage;
+
+
+// Spread the lower bits of v to the even bits (Morton order)
+static inline unsigned
+mortonSpread(unsigned v)
+{
+    v = (v | (v << 2)) & 0x33;
+    v = (v | (v << 1)) & 0x55;
+    return v;
+}
+
+
+// Index of texel (i,j) in the tiled copy
+static inline int
+tiledIndex(const Image* image, int i, int j)
+{
+    const int mask = (1 << IMAGETILELOG2) - 1;
+    int tile = (j >> IMAGETILELOG2) * image->tilesX + (i >> IMAGETILELOG2);
+    return (tile << (2 * IMAGETILELOG2)) | (mortonSpread(j & mask) << 1) | mortonSpread(i & mask);
+}
+
+
+// True if floats are stored least significant byte first (the PFM scale sign tells the order)
+static bool
+littleEndianHost()
+{
+    const unsigned one = 1;
+    return *(const unsigned char*) &one == 1;
+}
+
+
+// Read a PFM image ("PF" for RGB, converted to luminance, or "Pf" for grayscale)
+static void
+readImage(const char* filename, Image* image, bool bilinear)
+{
+    FILE* fd = fopen(filename, "rb");
+    char type[3] = {0, 0, 0};
+    int width, height, channels;
+    double scale;
+
+    if (!fd) {
+        printf("cannot open file '%s'\n", filename);
+        exit(1);
+    }
+    if (fscanf(fd, "%2s %i %i %lf", type, &width, &height, &scale) != 4 ||
+        type[0] != 'P' || (type[1] != 'F' && type[1] != 'f') || width <= 0 || height <= 0) {
+        printf("'%s' is not a PFM image\n", filename);
+        exit(1);
     }
+    fgetc(fd);   // single whitespace character before the data
+    channels = (type[1] == 'F') ? 3 : 1;
 
-    if (i == NUMFUNCTIONS) {
-        printf("Unknown function: '%s'\n", functionName);
+    size_t numValues = (size_t) width * height * channels;
+    float* data = (float *) malloc(numValues * sizeof(float));
+    if (fread(data, sizeof(float), numValues, fd) != numValues) {
+        printf("'%s' is too short\n", filename);
         exit(1);
     }
+    fclose(fd);
 
-    functionNumber = i;
-    reference = functionTable[i].refValue;
+    // Negative scale means little-endian data; swap bytes if that is not the native order
+    if ((scale < 0.0) != littleEndianHost()) {
+        for (size_t k = 0; k < numValues; k++) {
+            unsigned char* b = (unsigned char*) &data[k];
+            unsigned char c0 = b[0], c1 = b[1];
+            b[0] = b[3]; b[1] = b[2]; b[2] = c1; b[3] = c0;
+        }
+    }
 
-    samplesFilename = argv[2];
+    const int tileSize = 1 << IMAGETILELOG2;
+    int tilesY = (height + tileSize-1) / tileSize;
+    image->width = width;
+    image->height = height;
+    image->tilesX = (width + tileSize-1) / tileSize;
+    image->bilinear = bilinear;
+    image->texels = (float *) calloc((size_t) image->tilesX * tilesY * tileSize * tileSize,
+                                     sizeof(float));
+
+    // Summed-area table: sat[j][i] = sum of texels below row j and left of column i
+    double* sat = (double *) calloc((size_t) (width+1) * (height+1), sizeof(double));
+    for (int j = 0; j < height; j++) {
+        double rowSum = 0.0;
+        for (int i = 0; i < width; i++) {
+            const float* v = data + ((size_t) j * width + i) * channels;
+            float value = (channels == 3) ? 0.2126f*v[0] + 0.7152f*v[1] + 0.0722f*v[2] : v[0];
+            image->texels[tiledIndex(image, i, j)] = value;
+            rowSum += value;
+            sat[(size_t) (j+1) * (width+1) + (i+1)] = sat[(size_t) j * (width+1) + (i+1)] + rowSum;
+        }
+    }
+    image->refValue = sat[(size_t) height * (width+1) + width] / ((double) width * height);
 
-    if (argc > 3)
-        numSamples = atoi(argv[3]);   // number of sample points
+    free(sat);
+    free(data);
+}
 
-    if (argc > 4)
-        numSequences = atoi(argv[4]);   // number of sequences (trials)
 
-    // Read tables
+// Evaluate the image at (x,y)
+static inline double
+imageLookup(const Image* image, double x, double y)
+{
+    const int w = image->width, h = image->height;
 
-    // Open file with tables of sample points
-    fd = fopen(samplesFilename, "r");
-    if (!fd) {
-        printf("cannot open file '%s'\n", samplesFilename);
-        exit(1);
+    if (!image->bilinear) {
+        int i = MIN(MAX((int)(x * w), 0), w-1);
+        int j = MIN(MAX((int)(y * h), 0), h-1);
+        return image->texels[tiledIndex(image, i, j)];
     }
-    // Skip comments on first 3 lines
-    for (line = 0; line < 3; line++) skipLine(fd);
 
-    // Read numSequences sequences with numSamples sample points in each
-    for (t = 0; t < numSequences; t++) {
-        for (s = 0; s < numSamples; s++) {
-            ok = fscanf(fd, "%lf %lf", &x, &y);
-            if (ok == -1) break;   // too few sample points?
-            samplePoints[t][s].x = x;
-            samplePoints[t][s].y = y;
+    // Bilinear between texel centers, clamped to the edge texels
+    double fx = x * w - 0.5, fy = y * h - 0.5;
+    double fi = floor(fx), fj = floor(fy);
+    double u = fx - fi, v = fy - fj;
+    int i0 = MIN(MAX((int) fi, 0), w-1), i1 = MIN(MAX((int) fi + 1, 0), w-1);
+    int j0 = MIN(MAX((int) fj, 0), h-1), j1 = MIN(MAX((int) fj + 1, 0), h-1);
+    const float* texels = image->texels;
+    double bottom = (1.0-u) * texels[tiledIndex(image, i0, j0)] + u * texels[tiledIndex(image, i1, j0)];
+    double top = (1.0-u) * texels[tiledIndex(image, i0, j1)] + u * texels[tiledIndex(image, i1, j1)];
+    return (1.0-v) * bottom + v * top;
+}
+
+
+//
+// Expression integrands.
+//
+// An expression in x and y, for example "exp(-x*x - 4*y*y)", is parsed into an expression
+// tree, constant subexpressions are folded, and the tree is compiled to bytecode for a stack
+// machine.  Each bytecode instruction is applied to a whole block of EXPRBLOCK points before
+// the next instruction is decoded, so the interpretation overhead is amortized over the block
+// and the per-instruction loops vectorize.
+// Expressions can use + - * / ^, comparisons (giving 0 or 1), c ? a : b, the constants pi and
+// e, and the functions sin, cos, tan, asin, acos, atan, exp, log, sqrt, abs, floor, erf, min,
+// max, atan2 and pow.
+//
+
+#define EXPRFUNCTION (NUMFUNCTIONS+1)   // function number used for the expression integrand
+#define EXPRBLOCK 64                    // points per block in the bytecode interpreter
+#define EXPRMAXCODE 256                 // max instructions in compiled expression
+#define EXPRMAXSTACK 32                 // max stack depth of compiled expression
+#define EXPRREFCELLS 1024               // grid cells per axis for the reference integral
+#define EXPRREFSUBCELLS 8               // subcells per axis in refined cells
+#define EXPRREFMAXREFINED 16384         // max number of refined cells
+#define EXPRREFSPREAD 0.01              // value spread in a cell that causes refinement
+
+enum ExprOp {
+    OP_CONST, OP_X, OP_Y,
+    OP_NEG, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_POW,
+    OP_LT, OP_LE, OP_GT, OP_GE, OP_EQ, OP_NE, OP_SELECT,
+    OP_SIN, OP_COS, OP_TAN, OP_ASIN, OP_ACOS, OP_ATAN, OP_EXP, OP_LOG, OP_SQRT, OP_ABS,
+    OP_FLOOR, OP_ERF, OP_MIN, OP_MAX, OP_ATAN2
+};
+
+// Functions that can be called in expressions
+typedef struct ExprFunction {
+    const char* name;
+    int op;
+    int numArgs;
+} ExprFunction;
+
+const ExprFunction exprFunctions[] =
+{
+    {"sin", OP_SIN, 1}, {"cos", OP_COS, 1}, {"tan", OP_TAN, 1},
+    {"asin", OP_ASIN, 1}, {"acos", OP_ACOS, 1}, {"atan", OP_ATAN, 1},
+    {"exp", OP_EXP, 1}, {"log", OP_LOG, 1}, {"sqrt", OP_SQRT, 1},
+    {"abs", OP_ABS, 1}, {"floor", OP_FLOOR, 1}, {"erf", OP_ERF, 1},
+    {"min", OP_MIN, 2}, {"max", OP_MAX, 2}, {"atan2", OP_ATAN2, 2}, {"pow", OP_POW, 2},
+};
+
+typedef struct ExprNode {
+    int op;
+    double value;                 // for OP_CONST
+    struct ExprNode* args[3];
+} ExprNode;
+
+typedef struct Expression {
+    const char* text;
+    ExprNode* root;
+    int numCode;
+    unsigned char code[EXPRMAXCODE];
+    double constants[EXPRMAXCODE];   // constant for each OP_CONST instruction
+    double refValue;
+} Expression;
+
+Expression integrandExpression;
+
+
+// Number of arguments of an operator
+static int
+exprNumArgs(int op)
+{
+    if (op <= OP_Y) return 0;
+    if (op == OP_NEG || (op >= OP_SIN && op <= OP_ERF)) return 1;
+    if (op == OP_SELECT) return 3;
+    return 2;
+}
+
+
+static ExprNode*
+newExprNode(int op, double value, ExprNode* a0, ExprNode* a1, ExprNode* a2)
+{
+    ExprNode* node = (ExprNode *) malloc(sizeof(ExprNode));
+    node->op = op;
+    node->value = value;
+    node->args[0] = a0;
+    node->args[1] = a1;
+    node->args[2] = a2;
+    return node;
+}
+
+
+// Evaluate one operator on scalars.  Used for constant folding.
+static double
+exprApply(int op, double a, double b, double c)
+{
+    switch (op) {
+    case OP_NEG: return -a;
+    case OP_ADD: return a + b;
+    case OP_SUB: return a - b;
+    case OP_MUL: return a * b;
+    case OP_DIV: return a / b;
+    case OP_POW: return pow(a, b);
+    case OP_LT: return (a < b) ? 1.0 : 0.0;
+    case OP_LE: return (a <= b) ? 1.0 : 0.0;
+    case OP_GT: return (a > b) ? 1.0 : 0.0;
+    case OP_GE: return (a >= b) ? 1.0 : 0.0;
+    case OP_EQ: return (a == b) ? 1.0 : 0.0;
+    case OP_NE: return (a != b) ? 1.0 : 0.0;
+    case OP_SELECT: return (a != 0.0) ? b : c;
+    case OP_SIN: return sin(a);
+    case OP_COS: return cos(a);
+    case OP_TAN: return tan(a);
+    case OP_ASIN: return asin(a);
+    case OP_ACOS: return acos(a);
+    case OP_ATAN: return atan(a);
+    case OP_EXP: return exp(a);
+    case OP_LOG: return log(a);
+    case OP_SQRT: return sqrt(a);
+    case OP_ABS: return fabs(a);
+    case OP_FLOOR: return floor(a);
+    case OP_ERF: return erf(a);
+    case OP_MIN: return MIN(a, b);
+    case OP_MAX: return MAX(a, b);
+    case OP_ATAN2: return atan2(a, b);
+    }
+    return 0.0;
+}
+
+
+// Recursive descent parser.  Each function parses one precedence level.
+typedef struct ExprParser {
+    const char* text;
+    const char* p;
+} ExprParser;
+
+static ExprNode* parseExprTernary(ExprParser* parser);
+
+
+static void
+exprSyntaxError(ExprParser* parser, const char* message)
+{
+    printf("Error in expression '%s' at position %i: %s\n", parser->text,
+           (int)(parser->p - parser->text), message);
+    exit(1);
+}
+
+
+static void
+exprSkipSpace(ExprParser* parser)
+{
+    while (*parser->p == ' ' || *parser->p == '\t') parser->p++;
+}
+
+
+// Consume token if it is next
+static bool
+exprAccept(ExprParser* parser, const char* token)
+{
+    exprSkipSpace(parser);
+    size_t len = strlen(token);
+    if (strncmp(parser->p, token, len) != 0) return false;
+    parser->p += len;
+    return true;
+}
+
+
+static void
+exprExpect(ExprParser* parser, const char* token)
+{
+    if (!exprAccept(parser, token)) {
+        char message[64];
+        snprintf(message, sizeof(message), "expected '%s'", token);
+        exprSyntaxError(parser, message);
+    }
+}
+
+
+// primary := number | x | y | pi | e | function '(' args ')' | '(' expr ')'
+static ExprNode*
+parseExprPrimary(ExprParser* parser)
+{
+    exprSkipSpace(parser);
+    const char* p = parser->p;
+
+    if ((*p >= '0' && *p <= '9') || *p == '.') {
+        char* end;
+        double value = strtod(p, &end);
+        parser->p = end;
+        return newExprNode(OP_CONST, value, NULL, NULL, NULL);
+    }
+
+    if (exprAccept(parser, "(")) {
+        ExprNode* node = parseExprTernary(parser);
+        exprExpect(parser, ")");
+        return node;
+    }
+
+    // Identifier
+    int len = 0;
+    while ((p[len] >= 'a' && p[len] <= 'z') || (p[len] >= '0' && p[len] <= '9' && len > 0)) len++;
+    if (len == 0) exprSyntaxError(parser, "expected a number, variable or function");
+    parser->p += len;
+
+    if (len == 1 && p[0] == 'x') return newExprNode(OP_X, 0.0, NULL, NULL, NULL);
+    if (len == 1 && p[0] == 'y') return newExprNode(OP_Y, 0.0, NULL, NULL, NULL);
+    if (len == 1 && p[0] == 'e') return newExprNode(OP_CONST, M_E, NULL, NULL, NULL);
+    if (len == 2 && strncmp(p, "pi", 2) == 0) return newExprNode(OP_CONST, M_PI, NULL, NULL, NULL);
+
+    for (size_t f = 0; f < sizeof(exprFunctions) / sizeof(exprFunctions[0]); f++) {
+        if (strlen(exprFunctions[f].name) != (size_t) len || strncmp(p, exprFunctions[f].name, len))
+            continue;
+        ExprNode* args[2] = {NULL, NULL};
+        exprExpect(parser, "(");
+        for (int a = 0; a < exprFunctions[f].numArgs; a++) {
+            if (a > 0) exprExpect(parser, ",");
+            args[a] = parseExprTernary(parser);
         }
-        // Skip newline and one-line comment (Sequence number)
-        for (line = 0; line < 2; line++) skipLine(fd);
+        exprExpect(parser, ")");
+        return newExprNode(exprFunctions[f].op, 0.0, args[0], args[1], NULL);
     }
 
-    // Allocate and init
-    sumresults = (double *) malloc(numSequences * sizeof(double));
-    for (t = 0; t < numSequences; t++)
-        sumresults[t] = 0.0;   // memset?
+    parser->p = p;
+    exprSyntaxError(parser, "unknown variable or function");
+    return NULL;
+}
 
-    // Loop over sample counts 0 .. numSamples-1
-    for (s = 0; s < numSamples; s++) {
-        // Loop over sequences (aka. "trials")
-        sumerror = 0.0;
-        maxerror = 0.0;
-        for (t = 0; t < numSequences; t++) {
-            result = evaluateFunction(functionNumber, t, s);
 
-            sumresults[t] += result;
-            estimate = sumresults[t] / (s+1);
+// power := primary ['^' unary]   (right associative)
+static ExprNode* parseExprUnary(ExprParser* parser);
+
+static ExprNode*
+parseExprPower(ExprParser* parser)
+{
+    ExprNode* node = parseExprPrimary(parser);
+    if (exprAccept(parser, "^"))
+        node = newExprNode(OP_POW, 0.0, node, parseExprUnary(parser), NULL);
+    return node;
+}
+
 
-            error = fabs(estimate - reference);
-            sumerror += error;
-            maxerror = MAX(error, maxerror);
+// unary := ('-' | '+') unary | power
+static ExprNode*
+parseExprUnary(ExprParser* parser)
+{
+    if (exprAccept(parser, "-"))
+        return newExprNode(OP_NEG, 0.0, parseExprUnary(parser), NULL, NULL);
+    if (exprAccept(parser, "+"))
+        return parseExprUnary(parser);
+    return parseExprPower(parser);
+}
+
+
+// term := unary (('*' | '/') unary)*
+static ExprNode*
+parseExprTerm(ExprParser* parser)
+{
+    ExprNode* node = parseExprUnary(parser);
+    for (;;) {
+        if (exprAccept(parser, "*"))
+            node = newExprNode(OP_MUL, 0.0, node, parseExprUnary(parser), NULL);
+        else if (exprAccept(parser, "/"))
+            node = newExprNode(OP_DIV, 0.0, node, parseExprUnary(parser), NULL);
+        else
+            return node;
+    }
+}
+
+
+// sum := term (('+' | '-') term)*
+static ExprNode*
+parseExprSum(ExprParser* parser)
+{
+    ExprNode* node = parseExprTerm(parser);
+    for (;;) {
+        if (exprAccept(parser, "+"))
+            node = newExprNode(OP_ADD, 0.0, node, parseExprTerm(parser), NULL);
+        else if (exprAccept(parser, "-"))
+            node = newExprNode(OP_SUB, 0.0, node, parseExprTerm(parser), NULL);
+        else
+            return node;
+    }
+}
+
+
+// comparison := sum [('<' | '<=' | '>' | '>=' | '==' | '!=') sum]
+static ExprNode*
+parseExprComparison(ExprParser* parser)
+{
+    ExprNode* node = parseExprSum(parser);
+    int op = -1;
+    if (exprAccept(parser, "<=")) op = OP_LE;
+    else if (exprAccept(parser, ">=")) op = OP_GE;
+    else if (exprAccept(parser, "==")) op = OP_EQ;
+    else if (exprAccept(parser, "!=")) op = OP_NE;
+    else if (exprAccept(parser, "<")) op = OP_LT;
+    else if (exprAccept(parser, ">")) op = OP_GT;
+    if (op >= 0)
+        node = newExprNode(op, 0.0, node, parseExprSum(parser), NULL);
+    return node;
+}
+
+
+// ternary := comparison ['?' ternary ':' ternary]
+static ExprNode*
+parseExprTernary(ExprParser* parser)
+{
+    ExprNode* node = parseExprComparison(parser);
+    if (exprAccept(parser, "?")) {
+        ExprNode* a = parseExprTernary(parser);
+        exprExpect(parser, ":");
+        ExprNode* b = parseExprTernary(parser);
+        node = newExprNode(OP_SELECT, 0.0, node, a, b);
+    }
+    return node;
+}
+
+
+// Replace subtrees without x and y by constants
+static ExprNode*
+foldExprConstants(ExprNode* node)
+{
+    int n = exprNumArgs(node->op);
+    bool allConstant = (n > 0);
+    for (int a = 0; a < n; a++) {
+        node->args[a] = foldExprConstants(node->args[a]);
+        allConstant = allConstant && node->args[a]->op == OP_CONST;
+    }
+    if (allConstant) {
+        double v[3] = {0.0, 0.0, 0.0};
+        for (int a = 0; a < n; a++) {
+            v[a] = node->args[a]->value;
+            free(node->args[a]);
+            node->args[a] = NULL;
         }
-        aveerror = sumerror / numSequences; 
+        node->value = exprApply(node->op, v[0], v[1], v[2]);
+        node->op = OP_CONST;
+    }
+    return node;
+}
 
-        // Print error for 4, 8, 12, 16, ... samples
-        if ((s+1) % 4 == 0) {
-            printf("%i %f\n", s+1, aveerror);
-            fflush(stdout);
-        } 
+
+// Emit bytecode for the tree in post-order.  Returns the stack depth needed.
+static int
+compileExprNode(Expression* expr, const ExprNode* node)
+{
+    int depth = 0, n = exprNumArgs(node->op);
+    for (int a = 0; a < n; a++) {
+        int argDepth = a + compileExprNode(expr, node->args[a]);
+        depth = MAX(depth, argDepth);
+    }
+    if (expr->numCode == EXPRMAXCODE) {
+        printf("Expression '%s' is too long\n", expr->text);
+        exit(1);
     }
+    expr->constants[expr->numCode] = node->value;
+    expr->code[expr->numCode++] = (unsigned char) node->op;
+    return MAX(depth, 1);
+}
+
+
+// Evaluate the compiled expression at n points (x[k], y[k])
+static void
+evaluateExpression(const Expression* expr, const double* x, const double* y, double* out, int n)
+{
+    double stack[EXPRMAXSTACK][EXPRBLOCK];
+
+    for (int k0 = 0; k0 < n; k0 += EXPRBLOCK) {
+        const int m = MIN(EXPRBLOCK, n - k0);
+        const double* __restrict bx = x + k0;
+        const double* __restrict by = y + k0;
+        int top = -1;   // index of top of stack
+        int k;
+
+        for (int pc = 0; pc < expr->numCode; pc++) {
+            const int op = expr->code[pc];
+            double* __restrict r;
+            const double* __restrict a;
+            const double* __restrict b;
+            const double* __restrict c;
+
+            switch (op) {
+            case OP_CONST:
+                r = stack[++top];
+                for (k = 0; k < m; k++) r[k] = expr->constants[pc];
+                continue;
+            case OP_X:
+                r = stack[++top];
+                for (k = 0; k < m; k++) r[k] = bx[k];
+                continue;
+            case OP_Y:
+                r = stack[++top];
+                for (k = 0; k < m; k++) r[k] = by[k];
+                continue;
+            }
+
+            // Unary operators work in place on the top of the stack
+            r = stack[top];
+            switch (op) {
+            case OP_NEG: for (k = 0; k < m; k++) r[k] = -r[k]; continue;
+            case OP_SIN: for (k = 0; k < m; k++) r[k] = sin(r[k]); continue;
+            case OP_COS: for (k = 0; k < m; k++) r[k] = cos(r[k]); continue;
+            case OP_TAN: for (k = 0; k < m; k++) r[k] = tan(r[k]); continue;
+            case OP_ASIN: for (k = 0; k < m; k++) r[k] = asin(r[k]); continue;
+            case OP_ACOS: for (k = 0; k < m; k++) r[k] = acos(r[k]); continue;
+            case OP_ATAN: for (k = 0; k < m; k++) r[k] = atan(r[k]); continue;
+            case OP_EXP: for (k = 0; k < m; k++) r[k] = exp(r[k]); continue;
+            case OP_LOG: for (k = 0; k < m; k++) r[k] = log(r[k]); continue;
+            case OP_SQRT: for (k = 0; k < m; k++) r[k] = sqrt(r[k]); continue;
+            case OP_ABS: for (k = 0; k < m; k++) r[k] = fabs(r[k]); continue;
+            case OP_FLOOR: for (k = 0; k < m; k++) r[k] = floor(r[k]); continue;
+            case OP_ERF: for (k = 0; k < m; k++) r[k] = erf(r[k]); continue;
+            }
+
+            // Binary operators pop b and replace a with the result
+            if (op == OP_SELECT) {
+                c = stack[top--];
+                b = stack[top--];
+                r = stack[top];
+                for (k = 0; k < m; k++) r[k] = (r[k] != 0.0) ? b[k] : c[k];
+                continue;
+            }
+            b = stack[top--];
+            r = stack[top];
+            a = r;
+            switch (op) {
+            case OP_ADD: for (k = 0; k < m; k++) r[k] = a[k] + b[k]; break;
+            case OP_SUB: for (k = 0; k < m; k++) r[k] = a[k] - b[k]; break;
+            case OP_MUL: for (k = 0; k < m; k++) r[k] = a[k] * b[k]; break;
+            case OP_DIV: for (k = 0; k < m; k++) r[k] = a[k] / b[k]; break;
+            case OP_POW: for (k = 0; k < m; k++) r[k] = pow(a[k], b[k]); break;
+            case OP_LT: for (k = 0; k < m; k++) r[k] = (a[k] < b[k]) ? 1.0 : 0.0; break;
+            case OP_LE: for (k = 0; k < m; k++) r[k] = (a[k] <= b[k]) ? 1.0 : 0.0; break;
+            case OP_GT: for (k = 0; k < m; k++) r[k] = (a[k] > b[k]) ? 1.0 : 0.0; break;
+            case OP_GE: for (k = 0; k < m; k++) r[k] = (a[k] >= b[k]) ? 1.0 : 0.0; break;
+            case OP_EQ: for (k = 0; k < m; k++) r[k] = (a[k] == b[k]) ? 1.0 : 0.0; break;
+            case OP_NE: for (k = 0; k < m; k++) r[k] = (a[k] != b[k]) ? 1.0 : 0.0; break;
+            case OP_MIN: for (k = 0; k < m; k++) r[k] = MIN(a[k], b[k]); break;
+            case OP_MAX: for (k = 0; k < m; k++) r[k] = MAX(a[k], b[k]); break;
+            case OP_ATAN2: for (k = 0; k < m; k++) r[k] = atan2(a[k], b[k]); break;
+            }
+        }
+
+        for (k = 0; k < m; k++)
+            out[k0 + k] = stack[0][k];
+    }
+}
+
+
+// Integrate a batch-evaluated function over the unit square with 2x2 Gauss-Legendre points in
+// each of EXPRREFCELLS x EXPRREFCELLS cells.  Cells where the four values differ by more than
+// EXPRREFSPREAD (discontinuities and steep gradients) are integrated again with
+// EXPRREFSUBCELLS x EXPRREFSUBCELLS subcells, up to EXPRREFMAXREFINED cells.
+template <typename Func>
+static double
+integrateUnitSquare(Func evaluate)
+{
+    const int cells = EXPRREFCELLS, n = 2 * cells, sub = EXPRREFSUBCELLS;
+    const double g = 0.5 / sqrt(3.0);   // Gauss points at cell center -+ g * cell size
+    const int bufferSize = 2 * n + 4 * sub * sub;   // a row of cells and one refined cell
+    double* x = (double *) malloc(bufferSize * sizeof(double));
+    double* y = (double *) malloc(bufferSize * sizeof(double));
+    double* values = (double *) malloc(bufferSize * sizeof(double));
+    double sum = 0.0;
+    int i, j, k, numRefined = 0;
+
+    for (j = 0; j < cells; j++) {
+        // Evaluate the two rows of Gauss points of this row of cells
+        for (k = 0; k < 2 * n; k++) {
+            x[k] = (((k % n) >> 1) + 0.5 + ((k & 1) ? g : -g)) / cells;
+            y[k] = (j + 0.5 + ((k < n) ? -g : g)) / cells;
+        }
+        evaluate(x, y, values, 2 * n);
+
+        for (i = 0; i < cells; i++) {
+            double v0 = values[2*i], v1 = values[2*i + 1];
+            double v2 = values[n + 2*i], v3 = values[n + 2*i + 1];
+            double lo = MIN(MIN(v0, v1), MIN(v2, v3)), hi = MAX(MAX(v0, v1), MAX(v2, v3));
+            if (!(hi - lo > EXPRREFSPREAD) || numRefined == EXPRREFMAXREFINED) {
+                sum += 0.25 * (v0 + v1 + v2 + v3);
+                continue;
+            }
+
+            // Refine cell (i,j)
+            numRefined++;
+            double* sx = x + 2 * n;   // use the rest of the buffers
+            double* sy = y + 2 * n;
+            double* sv = values + 2 * n;
+            int m = 4 * sub * sub;
+            for (k = 0; k < m; k++) {
+                int si = k % (2 * sub), sj = k / (2 * sub);
+                sx[k] = (i + ((si >> 1) + 0.5 + ((si & 1) ? g : -g)) / sub) / cells;
+                sy[k] = (j + ((sj >> 1) + 0.5 + ((sj & 1) ? g : -g)) / sub) / cells;
+            }
+            evaluate(sx, sy, sv, m);
+            double cellSum = 0.0;
+            for (k = 0; k < m; k++) cellSum += sv[k];
+            sum += cellSum / m;
+        }
+    }
+
+    free(x); free(y); free(values);
+    return sum / ((double) cells * cells);
+}
+
+
+// Parse and compile an expression and compute its reference value if requested
+static void
+compileExpression(const char* text, Expression* expr, bool computeReference)
+{
+    ExprParser parser = { text, text };
+
+    expr->text = text;
+    expr->root = parseExprTernary(&parser);
+    exprSkipSpace(&parser);
+    if (*parser.p != '\0') exprSyntaxError(&parser, "unexpected character");
+    expr->root = foldExprConstants(expr->root);
+
+    expr->numCode = 0;
+    if (compileExprNode(expr, expr->root) > EXPRMAXSTACK) {
+        printf("Expression '%s' is too deeply nested\n", text);
+        exit(1);
+    }
+
+    if (!computeReference) return;
+    expr->refValue = integrateUnitSquare([expr](const double* x, const double* y, double* out, int n) {
+        evaluateExpression(expr, x, y, out, n);
+    });
+}
+
+
+//
+// Plugin integrands.
+//
+// A shared object implementing the interface in funcsamp2D_plugin.h is loaded with dlopen().
+// Its evaluate function is called once per batch of points.
+//
+
+#define PLUGINFUNCTION (NUMFUNCTIONS+2)   // function number used for the plugin integrand
+
+typedef struct Plugin {
+    void* handle;
+    const char* name;
+    double refValue;
+    Funcsamp2DEvaluateFunc evaluate;
+} Plugin;
+
+Plugin integrandPlugin;
+
+
+// Look up a symbol in a plugin
+static void*
+pluginSymbol(void* handle, const char* filename, const char* symbol)
+{
+    void* address = dlsym(handle, symbol);
+    if (!address) {
+        printf("Plugin '%s' does not define %s()\n", filename, symbol);
+        exit(1);
+    }
+    return address;
+}
+
+
+// Load a plugin and get its reference value
+static void
+loadPlugin(const char* filename, Plugin* plugin)
+{
+    plugin->handle = dlopen(filename, RTLD_NOW | RTLD_LOCAL);
+    if (!plugin->handle) {
+        printf("cannot load plugin '%s': %s\n", filename, dlerror());
+        exit(1);
+    }
+
+    Funcsamp2DPluginVersionFunc version =
+        (Funcsamp2DPluginVersionFunc) pluginSymbol(plugin->handle, filename, "funcsamp2D_pluginVersion");
+    if (version() != FUNCSAMP2D_PLUGIN_VERSION) {
+        printf("Plugin '%s' has version %i, expected %i\n", filename, version(),
+               FUNCSAMP2D_PLUGIN_VERSION);
+        exit(1);
+    }
+    plugin->name = ((Funcsamp2DNameFunc) pluginSymbol(plugin->handle, filename, "funcsamp2D_name"))();
+    plugin->refValue =
+        ((Funcsamp2DReferenceFunc) pluginSymbol(plugin->handle, filename, "funcsamp2D_reference"))();
+    plugin->evaluate =
+        (Funcsamp2DEvaluateFunc) pluginSymbol(plugin->handle, filename, "funcsamp2D_evaluate");
+
+    // Reference value not known: integrate numerically
+    if (isnan(plugin->refValue)) {
+        Funcsamp2DEvaluateFunc evaluate = plugin->evaluate;
+        plugin->refValue = integrateUnitSquare([evaluate](const double* x, const double* y,
+                                                          double* out, int n) {
+            evaluate(x, y, out, n);
+        });
+    }
+}
+
+
+//
+// JIT compilation of expression integrands.
+//
+// With --jit the expression tree is written out as a C function implementing the plugin
+// interface, compiled to a shared object with the system C compiler, and loaded as a plugin.
+// The compiler inlines and vectorizes the whole expression, so it runs as fast as a built-in
+// function.  If compilation fails, the bytecode interpreter is used instead.
+// The compiler can be set with the CC environment variable.
+//
+
+#define JITCOMPILER "cc"
+#define JITFLAGS "-O3 -march=native -fno-math-errno -shared -fPIC"
+
+
+// Write the C expression for an expression tree
+static void
+writeExprC(FILE* fd, const ExprNode* node)
+{
+    static const char* binaryOps[] = { "+", "-", "*", "/" };
+    static const char* compareOps[] = { "<", "<=", ">", ">=", "==", "!=" };
+    const char* function = NULL;
+    int op = node->op;
+
+    switch (op) {
+    case OP_CONST:
+        if (isnan(node->value)) fprintf(fd, "NAN");
+        else if (isinf(node->value)) fprintf(fd, "(%sHUGE_VAL)", node->value < 0.0 ? "-" : "");
+        else fprintf(fd, "%.17g", node->value);
+        return;
+    case OP_X: fprintf(fd, "X"); return;
+    case OP_Y: fprintf(fd, "Y"); return;
+    case OP_NEG:
+        fprintf(fd, "(-");
+        writeExprC(fd, node->args[0]);
+        fprintf(fd, ")");
+        return;
+    case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+        fprintf(fd, "(");
+        writeExprC(fd, node->args[0]);
+        fprintf(fd, " %s ", binaryOps[op - OP_ADD]);
+        writeExprC(fd, node->args[1]);
+        fprintf(fd, ")");
+        return;
+    case OP_LT: case OP_LE: case OP_GT: case OP_GE: case OP_EQ: case OP_NE:
+        fprintf(fd, "((");
+        writeExprC(fd, node->args[0]);
+        fprintf(fd, " %s ", compareOps[op - OP_LT]);
+        writeExprC(fd, node->args[1]);
+        fprintf(fd, ") ? 1.0 : 0.0)");
+        return;
+    case OP_SELECT:
+        fprintf(fd, "((");
+        writeExprC(fd, node->args[0]);
+        fprintf(fd, " != 0.0) ? ");
+        writeExprC(fd, node->args[1]);
+        fprintf(fd, " : ");
+        writeExprC(fd, node->args[2]);
+        fprintf(fd, ")");
+        return;
+    case OP_ABS: function = "fabs"; break;
+    case OP_MIN: function = "jitMin"; break;
+    case OP_MAX: function = "jitMax"; break;
+    default:
+        for (size_t f = 0; f < sizeof(exprFunctions) / sizeof(exprFunctions[0]); f++)
+            if (exprFunctions[f].op == op) function = exprFunctions[f].name;
+        break;
+    }
+
+    fprintf(fd, "%s(", function);
+    for (int a = 0; a < exprNumArgs(op); a++) {
+        if (a > 0) fprintf(fd, ", ");
+        writeExprC(fd, node->args[a]);
+    }
+    fprintf(fd, ")");
+}
+
+
+// Compile an expression to native code and load it as a plugin.  Returns false if that fails.
+static bool
+jitCompileExpression(const Expression* expr, Plugin* plugin)
+{
+    const char* tmpdir = getenv("TMPDIR");
+    const char* compiler = getenv("CC");
+    char dir[1024], sourceFilename[1100], objectFilename[1100], command[4096];
+    bool ok = false;
+
+    snprintf(dir, sizeof(dir), "%s/funcsamp2DXXXXXX", tmpdir ? tmpdir : "/tmp");
+    if (!mkdtemp(dir)) return false;
+    snprintf(sourceFilename, sizeof(sourceFilename), "%s/expr.c", dir);
+    snprintf(objectFilename, sizeof(objectFilename), "%s/expr.so", dir);
+
+    FILE* fd = fopen(sourceFilename, "w");
+    if (fd) {
+        fprintf(fd, "// %s\n", expr->text);
+        fprintf(fd, "#include <math.h>\n#include <stddef.h>\n\n");
+        fprintf(fd, "static inline double jitMin(double a, double b) { return (a < b) ? a : b; }\n");
+        fprintf(fd, "static inline double jitMax(double a, double b) { return (a > b) ? a : b; }\n\n");
+        fprintf(fd, "int funcsamp2D_pluginVersion(void) { return %i; }\n", FUNCSAMP2D_PLUGIN_VERSION);
+        fprintf(fd, "const char* funcsamp2D_name(void) { return \"expr\"; }\n");
+        fprintf(fd, "double funcsamp2D_reference(void) { return NAN; }\n\n");
+        fprintf(fd, "void funcsamp2D_evaluate(const double* restrict x, const double* restrict y,\n");
+        fprintf(fd, "                         double* restrict out, size_t n)\n{\n");
+        fprintf(fd, "    for (size_t k = 0; k < n; k++) {\n");
+        fprintf(fd, "        const double X = x[k], Y = y[k];\n");
+        fprintf(fd, "        out[k] = ");
+        writeExprC(fd, expr->root);
+        fprintf(fd, ";\n    }\n}\n");
+        fclose(fd);
+
+        snprintf(command, sizeof(command), "%s %s -o '%s' '%s' -lm", compiler ? compiler : JITCOMPILER,
+                 JITFLAGS, objectFilename, sourceFilename);
+        if (system(command) == 0) {
+            loadPlugin(objectFilename, plugin);   // the mapping stays valid after unlink
+            ok = true;
+        }
+    }
+
+    unlink(sourceFilename);
+    unlink(objectFilename);
+    rmdir(dir);
+    return ok;
+}
+
+
+// Evaluate function at point (x, y)
+double
+evaluateFunctionAt(int functionNum, double x, double y)
+{
+    Point sample = { x, y };
+    double result = 0.0;
+
+    switch (functionNum) {
+    // 2D:
+    case 0: result = quarterdisk(sample.x, sample.y); break;
+    case 1: result = fulldisk(sample.x, sample.y); break;
+    case 2: result = triangle(sample.x, sample.y); break;
+    case 3: result = quarterdiskramp(sample.x, sample.y); break;
+    case 4: result = fulldiskramp(sample.x, sample.y); break;
+    case 5: result = triangleramp(sample.x, sample.y); break;
+    case 6: result = quartergaussian2D(sample.x, sample.y); break;
+    case 7: result = fullgaussian2D(sample.x, sample.y); break;
+    case 8: result = bilinear(sample.x, sample.y); break;
+    case 9: result = biquadratic(sample.x, sample.y); break;
+    case 10: result = sinxy(sample.x, sample.y); break;
+    case 11: result = sininvr(sample.x, sample.y); break;
+    // 1D:
+    case 12: result = step(sample.x); break;
+    case 13: result = ramp(sample.x); break;
+    case 14: result = linear(sample.y); break;
+    case 15: result = gaussian1D(sample.x); break;
+    case 16: result = sinx(sample.y); break;
+    case 17: result = sin2x(sample.x); break;
+    // Image:
+    case IMAGEFUNCTION: result = imageLookup(&integrandImage, sample.x, sample.y); break;
+    case EXPRFUNCTION: evaluateExpression(&integrandExpression, &sample.x, &sample.y, &result, 1); break;
+    case PLUGINFUNCTION: integrandPlugin.evaluate(&sample.x, &sample.y, &result, 1); break;
+    }
+
+    return result;
+}
+
+
+// Evaluate function at n points (x[k], y[k]).  The switch is outside the loops over the
+// points, so each loop can be inlined and vectorized.
+void
+evaluateFunctionBatch(int functionNum, const double* __restrict x, const double* __restrict y,
+                      double* __restrict out, int n)
+{
+    int k;
+
+    // Polynomial exp and sin (--fastmath)
+    if (mathTier == MATHACCURATE &&
+        evaluateFastMathBatch<EXPDEGREEACCURATE, SINTERMSACCURATE>(functionNum, x, y, out, n))
+        return;
+    if (mathTier == MATHFAST &&
+        evaluateFastMathBatch<EXPDEGREEFAST, SINTERMSFAST>(functionNum, x, y, out, n))
+        return;
+
+    // The original piecewise functions (--branchy)
+    if (branchyIntegrands) {
+        switch (functionNum) {
+        case 5: for (k = 0; k < n; k++) out[k] = triangleramp(x[k], y[k]); return;
+        case 12: for (k = 0; k < n; k++) out[k] = step(x[k]); return;
+        case 13: for (k = 0; k < n; k++) out[k] = ramp(x[k]); return;
+        }
+    }
+
+    switch (functionNum) {
+    // 2D:
+    case 0: for (k = 0; k < n; k++) out[k] = quarterdisk(x[k], y[k]); break;
+    case 1: for (k = 0; k < n; k++) out[k] = fulldisk(x[k], y[k]); break;
+    case 2: for (k = 0; k < n; k++) out[k] = triangle(x[k], y[k]); break;
+    case 3: for (k = 0; k < n; k++) out[k] = quarterdiskramp(x[k], y[k]); break;
+    case 4: for (k = 0; k < n; k++) out[k] = fulldiskramp(x[k], y[k]); break;
+    case 5: for (k = 0; k < n; k++) out[k] = trianglerampBranchless(x[k], y[k]); break;
+    case 6: for (k = 0; k < n; k++) out[k] = quartergaussian2D(x[k], y[k]); break;
+    case 7: for (k = 0; k < n; k++) out[k] = fullgaussian2D(x[k], y[k]); break;
+    case 8: for (k = 0; k < n; k++) out[k] = bilinear(x[k], y[k]); break;
+    case 9: for (k = 0; k < n; k++) out[k] = biquadratic(x[k], y[k]); break;
+    case 10: for (k = 0; k < n; k++) out[k] = sinxy(x[k], y[k]); break;
+    case 11: for (k = 0; k < n; k++) out[k] = sininvr(x[k], y[k]); break;
+    // 1D:
+    case 12: for (k = 0; k < n; k++) out[k] = stepBranchless(x[k]); break;
+    case 13: for (k = 0; k < n; k++) out[k] = rampxBranchless(x[k]); break;
+    case 14: for (k = 0; k < n; k++) out[k] = linear(y[k]); break;
+    case 15: for (k = 0; k < n; k++) out[k] = gaussian1D(x[k]); break;
+    case 16: for (k = 0; k < n; k++) out[k] = sinx(y[k]); break;
+    case 17: for (k = 0; k < n; k++) out[k] = sin2x(x[k]); break;
+    // Image, expression and plugin:
+    case IMAGEFUNCTION:
+        for (k = 0; k < n; k++) out[k] = imageLookup(&integrandImage, x[k], y[k]);
+        break;
+    case EXPRFUNCTION: evaluateExpression(&integrandExpression, x, y, out, n); break;
+    case PLUGINFUNCTION: integrandPlugin.evaluate(x, y, out, n); break;
+    }
+}
+
+
+//
+// N-dimensional integrands.
+//
+// With --dim d each sample point in the sample file has d coordinates.  The file reader, the
+// sample tables and their randomized copies, and the error tables (the main one, --subranges
+// and --adaptive) are templates on the dimension D, and the 2D runs are the D = 2 instances
+// of them.  For D = 1 .. NDMAXFIXED the loops over the coordinates are unrolled by the
+// compiler; other dimensions (up to NDMAXDIM) use the same code with D = 0 and the dimension
+// known only at run time.  The named 2D functions, --image, --expr, --plugin, the integrand
+// families, --pair, discrepancy, spectrum, verify, bench and the owen-sobol and owen-halton
+// generators are 2D only.  The N-dimensional integrands, which work in any dimension
+// (including the default of 2), are:
+//   ballND       1 inside the ball with center (0.5, ..., 0.5) and radius 0.5
+//   gaussianND   exp(-|x|^2)
+//   simplexND    1 where x_0 + ... + x_(d-1) < d/2
+//   sinND        product of sin(pi x_i)
+//   quadraticND  sum of x_i^2
+// With --fastmath, gaussianND and sinND use the exp and sin polynomials.
+//
+
+#define NDMAXFIXED 8    // dimensions with compiled-in loops
+#define NDMAXDIM 64     // max dimension
+#define NUMFUNCTIONSND 5
+#define NDFUNCTION (NUMFUNCTIONS+3)   // function number of the first N-dimensional integrand
+
+enum FunctionNDType { FNDBALL, FNDGAUSSIAN, FNDSIMPLEX, FNDSIN, FNDQUADRATIC };
+
+const char* functionNamesND[NUMFUNCTIONSND] =
+    { "ballND", "gaussianND", "simplexND", "sinND", "quadraticND" };
+
+
+// Reference value of an N-dimensional function in dimension dim
+static double
+referenceND(int function, int dim)
+{
+    switch (function) {
+    case FNDBALL: return pow(M_PI, 0.5 * dim) / tgamma(0.5 * dim + 1.0) * pow(0.5, dim);
+    case FNDGAUSSIAN: return pow(0.5 * sqrt(M_PI) * erf(1.0), dim);
+    case FNDSIMPLEX: return 0.5;
+    case FNDSIN: return pow(2.0 / M_PI, dim);
+    case FNDQUADRATIC: return dim / 3.0;
+    }
+    return 0.0;
+}
+
+
+// Evaluate an N-dimensional function at the n points with coordinates x[d][k] (D = 0: dim
+// coordinates)
+template <int D>
+static void
+evaluateFunctionNDBatch(int function, int dim, const double* const* x, double* __restrict out,
+                        int n)
+{
+    const int nd = (D > 0) ? D : dim;
+    int k, d;
+
+    switch (function) {
+    case FNDBALL:
+        for (k = 0; k < n; k++) out[k] = 0.0;
+        for (d = 0; d < nd; d++) {
+            const double* __restrict xd = x[d];
+            for (k = 0; k < n; k++) out[k] += (xd[k] - 0.5) * (xd[k] - 0.5);
+        }
+        for (k = 0; k < n; k++) out[k] = (out[k] < 0.25) ? 1.0 : 0.0;
+        break;
+    case FNDGAUSSIAN:
+        for (k = 0; k < n; k++) out[k] = 0.0;
+        for (d = 0; d < nd; d++) {
+            const double* __restrict xd = x[d];
+            for (k = 0; k < n; k++) out[k] -= xd[k] * xd[k];
+        }
+        if (mathTier == MATHACCURATE)
+            for (k = 0; k < n; k++) out[k] = expPoly<EXPDEGREEACCURATE>(out[k]);
+        else if (mathTier == MATHFAST)
+            for (k = 0; k < n; k++) out[k] = expPoly<EXPDEGREEFAST>(out[k]);
+        else
+            for (k = 0; k < n; k++) out[k] = exp(out[k]);
+        break;
+    case FNDSIMPLEX:
+        for (k = 0; k < n; k++) out[k] = 0.0;
+        for (d = 0; d < nd; d++) {
+            const double* __restrict xd = x[d];
+            for (k = 0; k < n; k++) out[k] += xd[k];
+        }
+        for (k = 0; k < n; k++) out[k] = (out[k] < 0.5 * nd) ? 1.0 : 0.0;
+        break;
+    case FNDSIN:
+        for (k = 0; k < n; k++) out[k] = 1.0;
+        for (d = 0; d < nd; d++) {
+            const double* __restrict xd = x[d];
+            if (mathTier == MATHACCURATE)
+                for (k = 0; k < n; k++) out[k] *= sinPiPoly<SINTERMSACCURATE>(xd[k]);
+            else if (mathTier == MATHFAST)
+                for (k = 0; k < n; k++) out[k] *= sinPiPoly<SINTERMSFAST>(xd[k]);
+            else
+                for (k = 0; k < n; k++) out[k] *= sin(M_PI * xd[k]);
+        }
+        break;
+    case FNDQUADRATIC:
+        for (k = 0; k < n; k++) out[k] = 0.0;
+        for (d = 0; d < nd; d++) {
+            const double* __restrict xd = x[d];
+            for (k = 0; k < n; k++) out[k] += xd[k] * xd[k];
+        }
+        break;
+    }
+}
+
+
+// Evaluate function functionNumber at the n points with coordinates x[d][k]: the
+// N-dimensional functions in any dimension, the others in 2D only
+template <int D>
+static inline void
+evaluateTrialBatch(int functionNumber, int dim, double* const* x, double* __restrict out, int n)
+{
+    if (functionNumber >= NDFUNCTION)
+        evaluateFunctionNDBatch<D>(functionNumber - NDFUNCTION, dim, x, out, n);
+    else if (D == 2)
+        evaluateFunctionBatch(functionNumber, x[0], x[1], out, n);
+}
+
+
+// Number of the N-dimensional function called name, or -1
+static int
+findFunctionND(const char* name)
+{
+    for (int i = 0; i < NUMFUNCTIONSND; i++)
+        if (strcmp(name, functionNamesND[i]) == 0)
+            return i;
+    return -1;
+}
+
+
+// Call func(std::integral_constant<int, D>()) with D = dim for the dimensions with compiled-in
+// loops, and D = 0 for the others
+template <typename Func>
+static void
+withDimension(int dim, Func func)
+{
+    switch (dim) {
+    case 1: func(std::integral_constant<int, 1>()); break;
+    case 2: func(std::integral_constant<int, 2>()); break;
+    case 3: func(std::integral_constant<int, 3>()); break;
+    case 4: func(std::integral_constant<int, 4>()); break;
+    case 5: func(std::integral_constant<int, 5>()); break;
+    case 6: func(std::integral_constant<int, 6>()); break;
+    case 7: func(std::integral_constant<int, 7>()); break;
+    case 8: func(std::integral_constant<int, 8>()); break;
+    default: func(std::integral_constant<int, 0>()); break;
+    }
+}
+
+
+// Doubles in the row of a sequence in a sample table with dim coordinates per point.  The 2D
+// rows have room for MAXSAMPLES points, so a 2D table is also the Point table of the modes
+// that index samplePoints.
+static inline size_t
+sampleRowLength(int dim, int numSamples)
+{
+    return (size_t) dim * ((dim == 2) ? MAXSAMPLES : numSamples);
+}
+
+
+// A 2D sample table as rows of Points
+static inline Point
+(*pointRows(double* coords))[MAXSAMPLES]
+{
+    return (Point (*)[MAXSAMPLES]) coords;
+}
+
+
+// Read numSequences sequences with numSamples sample points in each from a sample file into
+// the rows of coords, with D coordinates per point (D = 0: dim coordinates)
+template <int D>
+static void
+readSamples(const char* samplesFilename, int dim, int numSamples, int numSequences,
+            double* coords)
+{
+    const int nd = (D > 0) ? D : dim;
+    const size_t rowLength = sampleRowLength(nd, numSamples);
+    double p[(D > 0) ? D : NDMAXDIM] = { 0.0 };
+    FILE *fd;
+    int s, t, d, line, ok;
+
+    if (numSamples > MAXSAMPLES || numSequences > MAXTABLES) {
+        printf("Too many samples or sequences (max %i samples, %i sequences)\n",
+               MAXSAMPLES, MAXTABLES);
+        exit(1);
+    }
+
+    // Open file with tables of sample points
+    fd = fopen(samplesFilename, "r");
+    if (!fd) {
+        printf("cannot open file '%s'\n", samplesFilename);
+        exit(1);
+    }
+    // Skip comments on first 3 lines
+    for (line = 0; line < 3; line++) skipLine(fd);
+
+    // Read numSequences sequences with numSamples sample points in each
+    for (t = 0; t < numSequences; t++) {
+        double* row = coords + t * rowLength;
+        for (s = 0; s < numSamples; s++) {
+            ok = fscanf(fd, "%lf", &p[0]);
+            if (ok == -1) break;   // too few sample points?
+            for (d = 1; d < nd && ok == 1; d++)
+                ok = fscanf(fd, "%lf", &p[d]);
+            for (d = 0; d < nd; d++)
+                row[s * nd + d] = p[d];
+        }
+        // Skip newline and one-line comment (Sequence number)
+        for (line = 0; line < 2; line++) skipLine(fd);
+    }
+
+    fclose(fd);
+}
+
+
+//
+// Randomized copies of the sequences.
+//
+// Each sequence can be used for numCopies trials, each with its own random toroidal
+// (Cranley-Patterson) shift, random digital shift (xor of the 32-bit fixed-point
+// coordinates), or random Owen scrambling of the 32-bit fixed-point coordinates.  The
+// randomized points are computed when the samples are gathered for evaluation, so the
+// copies are never stored.  Trial i uses sequence i / numCopies.
+//
+// Instead of a sample file, Owen-scrambled Sobol (dimensions 0 and 1) or Halton (bases 2 and
+// 3) points can be generated on the fly, with a different scrambling seed for every trial.
+// Then there is no limit on the number of trials.
+//
+// The Owen scrambling is hash-based: in base 2 a Laine-Karras style permutation of the
+// bit-reversed coordinate gives a nested uniform scramble with a few integer multiplies
+// (Burley, "Practical hash-based Owen scrambling", JCGT 2020).  In base 3 each digit is
+// permuted with one of the 6 permutations, chosen by a hash of the seed and higher digits.
+//
+
+enum ShiftType { SHIFTNONE, SHIFTCP, SHIFTXOR, SHIFTOWEN };
+enum SampleSource { SOURCEFILE, SOURCEOWENSOBOL, SOURCEOWENHALTON };
+
+#define HALTON3DIGITS 21   // 3^-21 is about 2^-32
+
+// The trials of a set of sample points
+typedef struct SampleSet {
+    const double* coords;           // sequences read from file (rows of sampleRowLength)
+    size_t rowLength;
+    int dim;                        // coordinates per point
+    int source;                     // sample file or generated scrambled points
+    int type;                       // randomization of the sequences
+    int numCopies;                  // randomized copies (trials) per sequence
+    unsigned seed;
+    double* shifts;                 // [trial][dimension] Cranley-Patterson shift
+    unsigned* xors;                 // [trial][dimension] digital shift
+} SampleSet;
+
+SampleSet sampleSet;
+
+
+// Set up the trials of sample set: random shifts for numTrials trials
+static void
+initSampleSet(SampleSet* set, const double* coords, int dim, int numSamples, int source,
+              int type, int numCopies, int numTrials, long seed)
+{
+    set->coords = coords;
+    set->rowLength = sampleRowLength(dim, numSamples);
+    set->dim = dim;
+    set->source = source;
+    set->type = type;
+    set->numCopies = numCopies;
+    set->seed = (unsigned) seed;
+    set->shifts = NULL;
+    set->xors = NULL;
+    if (type != SHIFTCP && type != SHIFTXOR) return;
+
+    // The shifts of a trial are drawn in the order x, y, xor x, xor y in 2D
+    set->shifts = (double *) malloc((size_t) numTrials * dim * sizeof(double));
+    set->xors = (unsigned *) malloc((size_t) numTrials * dim * sizeof(unsigned));
+    srand48(seed);
+    for (int i = 0; i < numTrials; i++) {
+        for (int d = 0; d < dim; d++)
+            set->shifts[(size_t) i * dim + d] = uniformrandom();
+        for (int d = 0; d < dim; d++)
+            set->xors[(size_t) i * dim + d] = (unsigned) (uniformrandom() * 4294967296.0);
+    }
+}
+
+
+// Convert between [0,1) and 32-bit fixed point
+static inline unsigned
+toFixedPoint(double x)
+{
+    return (x < 1.0) ? (unsigned) (x * 4294967296.0) : 0xffffffffu;
+}
+
+static inline double
+fromFixedPoint(unsigned u)
+{
+    return u * (1.0 / 4294967296.0);
+}
+
+
+static inline unsigned
+reverseBits(unsigned x)
+{
+    x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+    x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+    x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+    x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+    return (x >> 16) | (x << 16);
+}
+
+
+// Hash of a seed and a value (for per-trial and per-dimension seeds)
+static inline unsigned
+hashCombine(unsigned seed, unsigned v)
+{
+    unsigned h = seed ^ (v + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+    h ^= h >> 16;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+    return h;
+}
+
+
+// Permutation of x where each bit only depends on itself and the lower bits
+static inline unsigned
+laineKarrasPermutation(unsigned x, unsigned seed)
+{
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return x;
+}
+
+
+// Base-2 Owen scrambling of a 32-bit fixed-point coordinate
+static inline unsigned
+nestedUniformScramble(unsigned x, unsigned seed)
+{
+    return reverseBits(laineKarrasPermutation(reverseBits(x), seed));
+}
+
+
+// Sobol dimension 1 (primitive polynomial x+1) as 32-bit fixed point
+static inline unsigned
+sobolDimension1(unsigned i)
+{
+    unsigned v = 1u << 31, x = 0;
+    for (; i; i >>= 1, v ^= v >> 1)
+        if (i & 1) x ^= v;
+    return x;
+}
+
+
+// Owen-scrambled base-3 radical inverse of i
+static inline double
+owenScrambledRadicalInverse3(unsigned i, unsigned seed)
+{
+    static const unsigned char permutations[6][3] =
+        { {0,1,2}, {0,2,1}, {1,0,2}, {1,2,0}, {2,0,1}, {2,1,0} };
+    double result = 0.0, factor = 1.0 / 3.0;
+    unsigned h = seed;
+
+    for (int k = 0; k < HALTON3DIGITS; k++) {
+        unsigned d = i % 3;
+        i /= 3;
+        result += permutations[h % 6][d] * factor;
+        factor *= 1.0 / 3.0;
+        h = hashCombine(h, d);   // the next digit's permutation depends on this digit
+    }
+    return result;
+}
+
+
+// Sample point s of a generated trial
+static inline void
+generatedSample(const SampleSet* set, int trial, int s, double* x, double* y)
+{
+    unsigned trialSeed = hashCombine(set->seed, (unsigned) trial);
+    unsigned seed0 = hashCombine(trialSeed, 0), seed1 = hashCombine(trialSeed, 1);
+
+    // Dimension 0 is the base-2 radical inverse for both Sobol and Halton, and the
+    // scramble of the bit-reversed index simplifies to a permutation of the index
+    *x = fromFixedPoint(reverseBits(laineKarrasPermutation((unsigned) s, seed0)));
+    if (set->source == SOURCEOWENSOBOL)
+        *y = fromFixedPoint(nestedUniformScramble(sobolDimension1((unsigned) s), seed1));
+    else
+        *y = owenScrambledRadicalInverse3((unsigned) s, seed1);
+}
+
+
+// Coordinates p[0 .. dim-1] of sample point s of trial i, randomized if requested (D = 0: dim
+// coordinates; the generated sources are 2D)
+template <int D>
+static inline void
+trialPoint(const SampleSet* set, int trial, int s, double* p)
+{
+    const int nd = (D > 0) ? D : set->dim;
+
+    if (D == 2 && set->source != SOURCEFILE) {
+        generatedSample(set, trial, s, &p[0], &p[1]);
+        return;
+    }
+
+    const double* q = set->coords + (size_t) (trial / set->numCopies) * set->rowLength +
+                      (size_t) s * nd;
+    const double* shift = set->shifts + (size_t) trial * nd;
+    const unsigned* xorShift = set->xors + (size_t) trial * nd;
+    unsigned seed;
+    int d;
+
+    switch (set->type) {
+    case SHIFTNONE:
+    default:
+        for (d = 0; d < nd; d++)
+            p[d] = q[d];
+        break;
+    case SHIFTCP:
+        for (d = 0; d < nd; d++) {
+            p[d] = q[d] + shift[d];
+            if (p[d] >= 1.0) p[d] -= 1.0;
+        }
+        break;
+    case SHIFTXOR:
+        for (d = 0; d < nd; d++)
+            p[d] = fromFixedPoint(toFixedPoint(q[d]) ^ xorShift[d]);
+        break;
+    case SHIFTOWEN:
+        seed = hashCombine(set->seed, (unsigned) trial);
+        for (d = 0; d < nd; d++)
+            p[d] = fromFixedPoint(nestedUniformScramble(toFixedPoint(q[d]),
+                                                        hashCombine(seed, (unsigned) d)));
+        break;
+    }
+}
+
+
+// Sample point s of trial i of a 2D sample set
+static inline void
+trialSample(const SampleSet* set, int trial, int s, double* x, double* y)
+{
+    double p[2];
+    trialPoint<2>(set, trial, s, p);
+    *x = p[0];
+    *y = p[1];
+}
+
+
+// Gather sample s of trials trial0 .. trial0+n-1 into x[0][k], x[1][k], ...
+template <int D>
+static void
+gatherTrials(const SampleSet* set, int s, int trial0, int n, double* const* x)
+{
+    const int nd = (D > 0) ? D : set->dim;
+    double p[(D > 0) ? D : NDMAXDIM];
+    int k, d;
+
+    if (D == 2 && set->source == SOURCEOWENSOBOL) {
+        // Only integer ops; the loop vectorizes
+        double* __restrict xs = x[0];
+        double* __restrict ys = x[1];
+        const unsigned index = (unsigned) s, sobol1 = sobolDimension1(index);
+        for (k = 0; k < n; k++) {
+            unsigned trialSeed = hashCombine(set->seed, (unsigned) (trial0 + k));
+            xs[k] = fromFixedPoint(reverseBits(laineKarrasPermutation(index, hashCombine(trialSeed, 0))));
+            ys[k] = fromFixedPoint(nestedUniformScramble(sobol1, hashCombine(trialSeed, 1)));
+        }
+        return;
+    }
+    for (k = 0; k < n; k++) {
+        trialPoint<D>(set, trial0 + k, s, p);
+        for (d = 0; d < nd; d++)
+            x[d][k] = p[d];
+    }
+}
+
+
+// Gather samples 0 .. numSamples-1 of a trial into x[0][s], x[1][s], ...
+template <int D>
+static void
+gatherSequence(const SampleSet* set, int trial, int numSamples, double* const* x)
+{
+    const int nd = (D > 0) ? D : set->dim;
+    double p[(D > 0) ? D : NDMAXDIM];
+    int s, d;
+
+    if (D == 2 && set->source == SOURCEOWENSOBOL) {
+        double* __restrict xs = x[0];
+        double* __restrict ys = x[1];
+        unsigned trialSeed = hashCombine(set->seed, (unsigned) trial);
+        unsigned seed0 = hashCombine(trialSeed, 0), seed1 = hashCombine(trialSeed, 1);
+        for (s = 0; s < numSamples; s++) {
+            xs[s] = fromFixedPoint(reverseBits(laineKarrasPermutation((unsigned) s, seed0)));
+            ys[s] = fromFixedPoint(nestedUniformScramble(sobolDimension1((unsigned) s), seed1));
+        }
+        return;
+    }
+    for (s = 0; s < numSamples; s++) {
+        trialPoint<D>(set, trial, s, p);
+        for (d = 0; d < nd; d++)
+            x[d][s] = p[d];
+    }
+}
+
+
+//
+// Arena for the large arrays.
+//
+// The sample tables, the running sums of the trials, the cached function values, the prefix
+// sums of --subranges and the per-count error and power accumulators (ErrorSums, --adaptive,
+// the families, discrepancy and spectrum) are allocated from an arena that lives until the
+// program exits; the small per-thread scratch arrays are not.
+// The arena gets its memory in chunks of at least ARENACHUNK bytes, backed by 2 MB pages when
+// possible: first explicit huge pages from the hugetlbfs pool (MAP_HUGETLB, only if the
+// administrator has reserved them in /proc/sys/vm/nr_hugepages), then a 2 MB aligned mapping
+// marked for transparent huge pages (MADV_HUGEPAGE), and finally ordinary zeroed memory.  A
+// sweep over a sample table then needs one TLB entry per 2 MB instead of per 4 KB.  Memory
+// from the arena is zero, and pages are not touched before use, so --numa first-touch placement
+// still works (with 2 MB granularity).  --no-hugepages uses ordinary memory only; --perf
+// reports how each chunk is backed.
+//
+
+#define ARENACHUNK (64 << 20)      // minimum size of an arena chunk
+#define HUGEPAGESIZE (2 << 20)
+#define ARENAALIGN 4096            // alignment of the arrays: rows of the sample tables are pages
+
+struct ArenaChunk {
+    char* base;
+    size_t size, used;
+};
+
+bool hugePages = true;       // back the arena with huge pages when possible
+bool arenaReport = false;    // print the backing of each chunk on stderr (--perf)
+ArenaChunk arenaChunk = { NULL, 0, 0 };   // the chunk allocations are taken from
+
+
+// Get a zeroed chunk of at least size bytes, backed by huge pages if possible
+static void
+newArenaChunk(ArenaChunk* chunk, size_t size)
+{
+    const char* backing = "normal pages";
+    char* base = NULL;
+
+    size = (size + HUGEPAGESIZE - 1) / HUGEPAGESIZE * HUGEPAGESIZE;
+#ifdef __linux__
+    if (hugePages) {
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            base = (char *) p;
+            backing = "hugetlbfs pages";
+        }
+    }
+    if (hugePages && !base) {
+        // Over-allocate by a huge page and trim so the chunk starts on a 2 MB boundary
+        void* p = mmap(NULL, size + HUGEPAGESIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p != MAP_FAILED) {
+            char* start = (char *) p;
+            char* aligned = (char *) (((size_t) start + HUGEPAGESIZE - 1) & ~(size_t) (HUGEPAGESIZE - 1));
+            if (aligned > start)
+                munmap(start, aligned - start);
+            munmap(aligned + size, start + HUGEPAGESIZE - aligned);
+            base = aligned;
+            if (madvise(base, size, MADV_HUGEPAGE) == 0)
+                backing = "transparent huge pages";
+        }
+    }
+#endif
+    if (!base) {
+        base = (char *) calloc(size + ARENAALIGN, 1);
+        if (!base) {
+            printf("Out of memory (arena chunk of %zu MB)\n", size >> 20);
+            exit(1);
+        }
+        base = (char *) (((size_t) base + ARENAALIGN - 1) & ~(size_t) (ARENAALIGN - 1));
+    }
+    if (arenaReport)
+        fprintf(stderr, "arena: %zu MB chunk on %s\n", size >> 20, backing);
+    chunk->base = base;
+    chunk->size = size;
+    chunk->used = 0;
+}
+
+
+// Allocate n zeroed bytes from the arena.  The memory is never freed.
+static void*
+arenaAlloc(size_t n)
+{
+    n = (n + ARENAALIGN - 1) / ARENAALIGN * ARENAALIGN;
+    if (arenaChunk.used + n > arenaChunk.size)   // the rest of the current chunk is abandoned
+        newArenaChunk(&arenaChunk, MAX(n, (size_t) ARENACHUNK));
+    void* p = arenaChunk.base + arenaChunk.used;
+    arenaChunk.used += n;
+    return p;
+}
+
+
+// Sample table with rows for numSequences sequences (at most MAXTABLES; readSamples rejects more)
+// of numSamples points with dim coordinates
+static double*
+allocSampleTable(int numSequences, int dim, int numSamples)
+{
+    int rows = MAX(MIN(numSequences, MAXTABLES), 1);
+    return (double *) arenaAlloc(rows * sampleRowLength(dim, numSamples) * sizeof(double));
+}
+
+
+//
+// Cache of integrand values.
+//
+// With --cache the function values at all sample points of all trials are stored as floats
+// in a file next to the sample file, named <samplesFilename>.<key>.values, where the 64-bit
+// key is a hash of the sample file contents, the function (the name, or the contents of the
+// image or plugin file, or the expression) and the parameters that change the values (the
+// filter, --copies randomization, --fastmath, --jit, --dim).  If a matching cache file exists
+// the sample file is not parsed and the function is not evaluated; the error tables are then
+// computed from the cached values only.  --adaptive reads but does not write the cache,
+// since it evaluates only some of the trials; neither does a run resumed from a
+// --checkpoint, which evaluates only the samples after the checkpoint.  The values are
+// rounded to float also in the run that writes the cache, so all runs with --cache give the
+// same results.  The values are stored for sample 0 of all trials, then sample 1, etc., so a
+// tile of the main loop reads a run of consecutive values per sample.
+//
+
+#define CACHEMAGIC "FS2DVAL1"
+
+struct ValueCache {
+    char* filename;
+    unsigned long long key;
+    int numSamples, numTrials;
+    float* values;   // [sample][trial], NULL if there is no cache
+    bool loaded;     // the values were read from the cache file
+};
+
+ValueCache valueCache = { NULL, 0, 0, 0, NULL, false };
+
+
+// FNV-1a hash of n bytes, continuing from hash
+static unsigned long long
+hashBytes(unsigned long long hash, const void* data, size_t n)
+{
+    const unsigned char* bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < n; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+
+static unsigned long long
+hashString(unsigned long long hash, const char* text)
+{
+    return hashBytes(hash, text, strlen(text) + 1);
+}
+
+
+// Hash of the contents of a file
+static unsigned long long
+hashFile(unsigned long long hash, const char* filename)
+{
+    char buffer[65536];
+    size_t n;
+
+    FILE* fd = fopen(filename, "rb");
+    if (!fd) {
+        printf("cannot open file '%s'\n", filename);
+        exit(1);
+    }
+    while ((n = fread(buffer, 1, sizeof(buffer), fd)) > 0)
+        hash = hashBytes(hash, buffer, n);
+    fclose(fd);
+    return hash;
+}
+
+
+// Set up the cache for the given key and read the cache file if it exists and matches
+static void
+initValueCache(ValueCache* cache, const char* samplesFilename, unsigned long long key,
+               int numSamples, int numTrials)
+{
+    char magic[8];
+    unsigned long long fileKey;
+    int header[2];
+    size_t numValues = (size_t) numSamples * numTrials;
+
+    cache->filename = (char *) malloc(strlen(samplesFilename) + 32);
+    sprintf(cache->filename, "%s.%016llx.values", samplesFilename, key);
+    cache->key = key;
+    cache->numSamples = numSamples;
+    cache->numTrials = numTrials;
+    cache->values = (float *) arenaAlloc(numValues * sizeof(float));
+    cache->loaded = false;
+
+    FILE* fd = fopen(cache->filename, "rb");
+    if (!fd)
+        return;
+    if (fread(magic, 1, 8, fd) == 8 && memcmp(magic, CACHEMAGIC, 8) == 0 &&
+        fread(&fileKey, sizeof(fileKey), 1, fd) == 1 && fileKey == key &&
+        fread(header, sizeof(int), 2, fd) == 2 &&
+        header[0] == numSamples && header[1] == numTrials &&
+        fread(cache->values, sizeof(float), numValues, fd) == numValues)
+        cache->loaded = true;
+    else
+        fprintf(stderr, "Ignoring invalid cache file '%s'\n", cache->filename);
+    fclose(fd);
+}
+
+
+// Write the values to the cache file (via a temporary file, so that concurrent runs never
+// see a partly written cache)
+static void
+writeValueCache(const ValueCache* cache)
+{
+    if (!cache->values || cache->loaded)
+        return;
+
+    char* tmpFilename = (char *) malloc(strlen(cache->filename) + 32);
+    sprintf(tmpFilename, "%s.%i.tmp", cache->filename, (int) getpid());
+    FILE* fd = fopen(tmpFilename, "wb");
+    if (!fd) {
+        fprintf(stderr, "Cannot write cache file '%s'\n", tmpFilename);
+        free(tmpFilename);
+        return;
+    }
+    size_t numValues = (size_t) cache->numSamples * cache->numTrials;
+    int header[2] = { cache->numSamples, cache->numTrials };
+    bool ok = fwrite(CACHEMAGIC, 1, 8, fd) == 8 &&
+              fwrite(&cache->key, sizeof(cache->key), 1, fd) == 1 &&
+              fwrite(header, sizeof(int), 2, fd) == 2 &&
+              fwrite(cache->values, sizeof(float), numValues, fd) == numValues;
+    ok = (fclose(fd) == 0) && ok;
+    if (!ok || rename(tmpFilename, cache->filename) != 0) {
+        fprintf(stderr, "Cannot write cache file '%s'\n", cache->filename);
+        unlink(tmpFilename);
+    }
+    free(tmpFilename);
+}
+
+
+// Function values at sample s of trials trial0 .. trial0+n-1.  x[d] are scratch arrays for
+// the coordinates.
+template <int D>
+static void
+trialValues(int functionNumber, int s, int trial0, int n, double* const* x,
+            double* __restrict out)
+{
+    float* cached = valueCache.values ? valueCache.values + (size_t) s * valueCache.numTrials + trial0
+                                      : NULL;
+    int k;
+
+    if (valueCache.loaded) {
+        for (k = 0; k < n; k++) out[k] = cached[k];
+        return;
+    }
+    gatherTrials<D>(&sampleSet, s, trial0, n, x);
+    evaluateTrialBatch<D>(functionNumber, sampleSet.dim, x, out, n);
+    if (cached) {
+        for (k = 0; k < n; k++) {
+            cached[k] = (float) out[k];
+            out[k] = cached[k];
+        }
+    }
+}
+
+
+// Function values at samples 0 .. numSamples-1 of a trial.  x[d] are scratch arrays for the
+// coordinates.
+template <int D>
+static void
+sequenceValues(int functionNumber, int trial, int numSamples, double* const* x,
+               double* __restrict out)
+{
+    const size_t stride = valueCache.numTrials;
+    float* cached = valueCache.values ? valueCache.values + trial : NULL;
+    int s;
+
+    if (valueCache.loaded) {
+        for (s = 0; s < numSamples; s++) out[s] = cached[s * stride];
+        return;
+    }
+    gatherSequence<D>(&sampleSet, trial, numSamples, x);
+    evaluateTrialBatch<D>(functionNumber, sampleSet.dim, x, out, numSamples);
+    if (cached) {
+        for (s = 0; s < numSamples; s++) {
+            cached[s * stride] = (float) out[s];
+            out[s] = cached[s * stride];
+        }
+    }
+}
+
+
+//
+// Exact error sums.
+//
+// The main loop adds the errors of the trials as doubles in trial order, and for a sharded
+// run (--sequence-range or --partial) also in 128-bit fixed point with 64 fraction bits
+// (each error rounded to the nearest multiple of 2^-64).  Integer addition is associative,
+// so the fixed-point sums do not depend on the order the trials are added in: a run split
+// into sequence ranges gives partial sums that merge into exactly the sums of a single run.
+// The double sums of a plain run are the ones printed, as they always were.
+// Errors that are not finite or not below EXACTMAXERROR cannot be converted; they are added
+// to a plain double sum ("outside") instead, so an integrand that is inf or nan at a sample
+// point still gives an inf or nan error.
+//
+
+typedef __int128 ExactSum;
+
+#define EXACTSCALE 18446744073709551616.0   // 2^64
+#define EXACTMAXERROR 4294967296.0          // 2^32: the sum of 2^31 such errors fits in 127 bits
+
+static inline ExactSum
+toExactSum(double value)
+{
+    return (ExactSum) rint(value * EXACTSCALE);
+}
+
+static inline double
+fromExactSum(ExactSum sum)
+{
+    return (double) sum / EXACTSCALE;
+}
+
+// The part of an error that goes into the exact sum, and the part that goes into the outside sum
+static inline ExactSum
+exactPart(double error)
+{
+    return toExactSum((error < EXACTMAXERROR) ? error : 0.0);
+}
+
+static inline double
+outsidePart(double error)
+{
+    return (error < EXACTMAXERROR) ? 0.0 : error;
+}
+
+
+// The main loop goes over tiles of SAMPLETILE sample counts by TRIALTILE trials.  The values of
+// a tile (32 KB) stay in L1 and the sample table rows it reads (64 KB) in L2, however many
+// trials there are.  accumulateTile keeps the running sum of a trial in a register across the
+// sample counts of the tile and writes the errors of the tile to a buffer; addTileErrors then
+// adds them to the double sums in trial order.  The tiles of a block of sample counts are split
+// over the threads in runs of up to MAINTILERUN consecutive tiles (run k goes to thread k mod
+// the number of threads), and thread 0 adds the errors of all runs in order, so the sums are
+// the same for any number of threads.
+#define SAMPLETILE 16
+#define TRIALTILE EVALBATCH
+#define MAINTILERUN 8      // the errors of a run take 256 KB
+
+// Add the values [sample][trial] of samples s0 .. s1-1 of n trials to the running sums of the
+// trials, and write the errors to errors[trial][sample - s0].  With Exact the errors are also
+// added to exactErrors (exact sums do not depend on the order).  Four trials are done at a
+// time.
+template <bool Exact>
+static void
+accumulateTile(const double* __restrict values, int n, int s0, int s1, double reference,
+               double* __restrict runningSums, double* __restrict errors,
+               ExactSum* __restrict exactErrors)
+{
+    int t = 0;
+    for (; t + 4 <= n; t += 4) {
+        double sum0 = runningSums[t], sum1 = runningSums[t+1];
+        double sum2 = runningSums[t+2], sum3 = runningSums[t+3];
+        for (int s = s0; s < s1; s++) {
+            const double* v = values + (s - s0) * TRIALTILE + t;
+            sum0 += v[0]; sum1 += v[1]; sum2 += v[2]; sum3 += v[3];
+            double e0 = fabs(sum0 / (s+1) - reference), e1 = fabs(sum1 / (s+1) - reference);
+            double e2 = fabs(sum2 / (s+1) - reference), e3 = fabs(sum3 / (s+1) - reference);
+            double* e = errors + t * SAMPLETILE + (s - s0);
+            e[0] = e0; e[SAMPLETILE] = e1; e[2 * SAMPLETILE] = e2; e[3 * SAMPLETILE] = e3;
+            if (Exact)
+                exactErrors[s - s0] += exactPart(e0) + exactPart(e1) + exactPart(e2) +
+                                       exactPart(e3);
+        }
+        runningSums[t] = sum0; runningSums[t+1] = sum1;
+        runningSums[t+2] = sum2; runningSums[t+3] = sum3;
+    }
+    for (; t < n; t++) {
+        double sum = runningSums[t];
+        for (int s = s0; s < s1; s++) {
+            sum += values[(s - s0) * TRIALTILE + t];
+            double error = fabs(sum / (s+1) - reference);
+            errors[t * SAMPLETILE + (s - s0)] = error;
+            if (Exact)
+                exactErrors[s - s0] += exactPart(error);
+        }
+        runningSums[t] = sum;
+    }
+}
+
+// Add the errors [trial][count] of n trials written by accumulateTile to the double sums of
+// numCounts sample counts, in trial order (the outside sums only if Exact)
+template <bool Exact>
+static void
+addTileErrors(const double* __restrict errors, int n, int numCounts,
+              double* __restrict plainErrors, double* __restrict squaredErrors,
+              double* __restrict outsideErrors)
+{
+    for (int t = 0; t < n; t++) {
+        const double* e = errors + t * SAMPLETILE;
+        for (int c = 0; c < numCounts; c++) {
+            plainErrors[c] += e[c];
+            squaredErrors[c] += e[c] * e[c];
+            if (Exact)
+                outsideErrors[c] += outsidePart(e[c]);
+        }
+    }
+}
+
+// Split of the trial tiles of the main loop over the threads
+struct MainLoopSplit {
+    int numThreads;
+    int runTrials;     // trials in a run of tiles
+};
+
+static MainLoopSplit
+mainLoopSplit(int numTrials, int threads)
+{
+    MainLoopSplit split;
+    int numTiles = (numTrials + TRIALTILE - 1) / TRIALTILE;
+    split.numThreads = MAX(MIN(threads, numTiles), 1);
+    int runTiles = (numTiles + split.numThreads - 1) / split.numThreads;
+    split.runTrials = MIN(runTiles, MAINTILERUN) * TRIALTILE;
+    return split;
+}
+
+// Thread that evaluates the trial at offset trial from the first trial of the range
+static inline int
+mainLoopThread(const MainLoopSplit* split, int trial)
+{
+    return (trial / split->runTrials) % split->numThreads;
+}
+
+// Error sums of trials trialBegin .. trialEnd-1 of a run with numTrials trials, for the sample
+// counts 4, 8, 12, ...
+struct ErrorSums {
+    int numSamples, numTrials;
+    int trialBegin, trialEnd;
+    int numCounts;             // number of counts done
+    double* plain;             // [count] sums of the errors, added as doubles in trial order
+    ExactSum* sums;            // [count] sums of the errors of the trials (sharded runs only)
+    double* outside;           // [count] sums of the errors that are not below EXACTMAXERROR
+    double* squares;           // [count] sums of the squared errors
+};
+
+
+static void
+initErrorSums(ErrorSums* errorSums, int numSamples, int numTrials, int trialBegin, int trialEnd)
+{
+    errorSums->numSamples = numSamples;
+    errorSums->numTrials = numTrials;
+    errorSums->trialBegin = trialBegin;
+    errorSums->trialEnd = trialEnd;
+    errorSums->numCounts = 0;
+    const size_t n = numSamples / OUTPUTINTERVAL + 1;
+    errorSums->plain = (double *) arenaAlloc(n * sizeof(double));
+    errorSums->sums = (ExactSum *) arenaAlloc(n * sizeof(ExactSum));
+    errorSums->outside = (double *) arenaAlloc(n * sizeof(double));
+    errorSums->squares = (double *) arenaAlloc(n * sizeof(double));
+}
+
+
+// Write the header and error sums; returns false on a write error
+static bool
+writeErrorSums(FILE* fd, const char* magic, unsigned long long key, const ErrorSums* errorSums)
+{
+    int header[5] = { errorSums->numSamples, errorSums->numTrials, errorSums->trialBegin,
+                      errorSums->trialEnd, errorSums->numCounts };
+    const size_t n = errorSums->numCounts;
+    return fwrite(magic, 1, 8, fd) == 8 &&
+           fwrite(&key, sizeof(key), 1, fd) == 1 &&
+           fwrite(header, sizeof(int), 5, fd) == 5 &&
+           fwrite(errorSums->plain, sizeof(double), n, fd) == n &&
+           fwrite(errorSums->sums, sizeof(ExactSum), n, fd) == n &&
+           fwrite(errorSums->outside, sizeof(double), n, fd) == n &&
+           fwrite(errorSums->squares, sizeof(double), n, fd) == n;
+}
+
+
+// Read the header and error sums written by writeErrorSums and allocate the arrays.  Returns
+// false if the file is not of this type or key (any key if key is 0), or is truncated.
+static bool
+readErrorSums(FILE* fd, const char* magic, unsigned long long* key, ErrorSums* errorSums)
+{
+    char fileMagic[8];
+    unsigned long long fileKey;
+    int header[5];
+
+    if (fread(fileMagic, 1, 8, fd) != 8 || memcmp(fileMagic, magic, 8) != 0 ||
+        fread(&fileKey, sizeof(fileKey), 1, fd) != 1 || (*key != 0 && fileKey != *key) ||
+        fread(header, sizeof(int), 5, fd) != 5)
+        return false;
+    if (header[0] <= 0 || header[1] <= 0 || header[2] < 0 || header[3] > header[1] ||
+        header[2] >= header[3] || header[4] < 0 || header[4] > header[0] / OUTPUTINTERVAL)
+        return false;
+    *key = fileKey;
+    initErrorSums(errorSums, header[0], header[1], header[2], header[3]);
+    errorSums->numCounts = header[4];
+    const size_t n = errorSums->numCounts;
+    return fread(errorSums->plain, sizeof(double), n, fd) == n &&
+           fread(errorSums->sums, sizeof(ExactSum), n, fd) == n &&
+           fread(errorSums->outside, sizeof(double), n, fd) == n &&
+           fread(errorSums->squares, sizeof(double), n, fd) == n;
+}
+
+
+//
+// Checkpoints of the main loop.
+//
+// With --checkpoint file the state of the main loop is written to the file every
+// checkpointInterval seconds (default 60, set with --checkpoint-every): the error sums of the
+// sample counts done so far and the running sums of the function values of the trials.  With
+// --resume the run continues from the state in the file, after printing the saved errors
+// again.  The file has a key for the sample file, function and parameters, and is only used
+// by a run with the same key and sequence range; it is written via a temporary file and
+// removed when the run is complete.
+//
+
+#define CHECKPOINTMAGIC "FS2DCKP4"
+#define CHECKPOINTINTERVAL 60.0   // seconds
+
+
+// Wall-clock time in seconds
+static double
+wallTime()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + 1e-9 * ts.tv_nsec;
+}
+
+
+// Write a checkpoint: the error sums and the running sums of trials trialBegin .. trialEnd-1
+static void
+writeCheckpoint(const char* filename, unsigned long long key, const ErrorSums* errorSums,
+                const double* sumresults)
+{
+    char* tmpFilename = (char *) malloc(strlen(filename) + 32);
+    sprintf(tmpFilename, "%s.%i.tmp", filename, (int) getpid());
+    FILE* fd = fopen(tmpFilename, "wb");
+    if (!fd) {
+        fprintf(stderr, "Cannot write checkpoint '%s'\n", tmpFilename);
+        free(tmpFilename);
+        return;
+    }
+    const size_t n = errorSums->trialEnd - errorSums->trialBegin;
+    bool ok = writeErrorSums(fd, CHECKPOINTMAGIC, key, errorSums) &&
+              fwrite(sumresults + errorSums->trialBegin, sizeof(double), n, fd) == n;
+    ok = (fclose(fd) == 0) && ok;
+    if (!ok || rename(tmpFilename, filename) != 0) {
+        fprintf(stderr, "Cannot write checkpoint '%s'\n", filename);
+        unlink(tmpFilename);
+    }
+    free(tmpFilename);
+}
+
+
+// Read a checkpoint into errorSums and sumresults.  Returns false if there is no checkpoint
+// file; exits if it is not for this run.
+static bool
+readCheckpoint(const char* filename, unsigned long long key, ErrorSums* errorSums,
+               double* sumresults)
+{
+    ErrorSums saved;
+    FILE* fd = fopen(filename, "rb");
+    if (!fd)
+        return false;
+    bool ok = readErrorSums(fd, CHECKPOINTMAGIC, &key, &saved) &&
+              saved.numSamples == errorSums->numSamples &&
+              saved.numTrials == errorSums->numTrials &&
+              saved.trialBegin == errorSums->trialBegin && saved.trialEnd == errorSums->trialEnd;
+    if (ok) {
+        const size_t n = saved.trialEnd - saved.trialBegin;
+        ok = fread(sumresults + saved.trialBegin, sizeof(double), n, fd) == n;
+        *errorSums = saved;
+    }
+    fclose(fd);
+    if (!ok) {
+        printf("Checkpoint '%s' is not for this run\n", filename);
+        exit(1);
+    }
+    return true;
+}
+
+
+//
+// Error output and convergence-rate fits.
+//
+// Every error table line goes through printError(), which also records the sample count and
+// error.  With --fit lo:hi the slope of log(error) against log(N) for lo <= N <= hi is fitted
+// by least squares, and a comment line with the slope, its 95% confidence interval and the
+// constant c in error = c N^slope is printed after the table.  The confidence interval
+// assumes independent residuals; the errors at different counts come from the same
+// sequences, so it is somewhat too narrow.
+//
+
+#define MAXFITS 16
+
+struct FitRange {
+    int lo, hi;
+};
+
+FitRange fitRanges[MAXFITS];
+int numFitRanges = 0;
+int numErrors = 0, maxErrors = 0;
+int* errorCounts = NULL;
+double* errorValues = NULL;
+
+
+// Print and record one line of an error table
+static void
+printError(int n, double error)
+{
+    printf("%i %f\n", n, error);
+    if (numFitRanges == 0)
+        return;
+    if (numErrors == maxErrors) {
+        maxErrors = MAX(2 * maxErrors, 1024);
+        errorCounts = (int *) realloc(errorCounts, maxErrors * sizeof(int));
+        errorValues = (double *) realloc(errorValues, maxErrors * sizeof(double));
+    }
+    errorCounts[numErrors] = n;
+    errorValues[numErrors] = error;
+    numErrors++;
+}
+
+
+// Parse "lo:hi[,lo:hi...]" into fitRanges.  Returns false on a syntax error.
+static bool
+parseFitRanges(const char* text)
+{
+    const char* c = text;
+    while (*c) {
+        int lo, hi, length;
+        if (numFitRanges == MAXFITS ||
+            sscanf(c, "%i:%i%n", &lo, &hi, &length) != 2 || lo <= 0 || hi <= lo)
+            return false;
+        fitRanges[numFitRanges].lo = lo;
+        fitRanges[numFitRanges].hi = hi;
+        numFitRanges++;
+        c += length;
+        if (*c == ',') c++;
+        else if (*c) return false;
+    }
+    return true;
+}
+
+
+// Two-sided 95% quantile of Student's t distribution with df degrees of freedom: from a
+// table for df <= 30, else the Cornish-Fisher expansion around the normal quantile to third
+// order (error below 1e-5 for df > 30)
+static double
+studentT95(int df)
+{
+    static const double table[30] = {
+        12.7062, 4.3027, 3.1824, 2.7764, 2.5706, 2.4469, 2.3646, 2.3060, 2.2622, 2.2281,
+        2.2010, 2.1788, 2.1604, 2.1448, 2.1314, 2.1199, 2.1098, 2.1009, 2.0930, 2.0860,
+        2.0796, 2.0739, 2.0687, 2.0639, 2.0595, 2.0555, 2.0518, 2.0484, 2.0452, 2.0423 };
+    const double z = 1.959964;
+    const double z3 = z*z*z, z5 = z3*z*z, z7 = z5*z*z;
+    const double n = df;
+    if (df <= 30) return table[MAX(df, 1) - 1];
+    return z + (z3 + z) / (4.0 * n) + (5.0*z5 + 16.0*z3 + 3.0*z) / (96.0 * n * n) +
+           (3.0*z7 + 19.0*z5 + 17.0*z3 - 15.0*z) / (384.0 * n * n * n);
+}
+
+
+// Print one comment line with the log-log fit for each range in fitRanges
+static void
+printFits()
+{
+    if (numFitRanges == 0)
+        return;
+    printf("# fit");
+    for (int r = 0; r < numFitRanges; r++) {
+        const int lo = fitRanges[r].lo, hi = fitRanges[r].hi;
+        printf("%sN=%i..%i: ", (r > 0) ? "; " : " ", lo, hi);
+        double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+        int m = 0;
+        for (int k = 0; k < numErrors; k++) {
+            if (errorCounts[k] < lo || errorCounts[k] > hi || errorValues[k] <= 0.0)
+                continue;
+            double x = log((double) errorCounts[k]), y = log(errorValues[k]);
+            sx += x; sy += y; sxx += x*x; sxy += x*y;
+            m++;
+        }
+        if (m < 3) {
+            printf("too few points");
+            continue;
+        }
+        double xmean = sx / m, ymean = sy / m;
+        double varx = sxx - m * xmean * xmean;
+        double slope = (sxy - m * xmean * ymean) / varx;
+        double intercept = ymean - slope * xmean;
+        double sse = 0.0;
+        for (int k = 0; k < numErrors; k++) {
+            if (errorCounts[k] < lo || errorCounts[k] > hi || errorValues[k] <= 0.0)
+                continue;
+            double residual = log(errorValues[k]) - (intercept + slope * log((double) errorCounts[k]));
+            sse += residual * residual;
+        }
+        double slopeError = sqrt(sse / (m - 2) / varx);
+        printf("slope %.4f +- %.4f c %.4g", slope,
+               studentT95(m - 2) * slopeError, exp(intercept));
+    }
+    printf("\n");
+    fflush(stdout);
+}
+
+
+//
+// Sharded runs.
+//
+// With --sequence-range a:b only sequences a .. b-1 are used (trials a*k .. b*k-1 with
+// --copies k), and with --partial file the error sums of these trials are written to a
+// binary file: the run key, the number of samples and trials, the trial range and, for each
+// sample count, the exact sum of the errors, the outside sum and the sum of the squared
+// errors.  "funcsamp2D merge" adds the partial files of a set of ranges that cover all trials
+// and prints the same error table as a single --partial run over all sequences (unless some
+// errors are not below EXACTMAXERROR: their double sums depend on the order they are added
+// in).  A plain run prints its double sums, which may differ from this in the last digit.
+//
+
+#define PARTIALMAGIC "FS2DPRT3"
+
+
+static void
+writePartial(const char* filename, unsigned long long key, const ErrorSums* errorSums)
+{
+    FILE* fd = fopen(filename, "wb");
+    if (!fd || !writeErrorSums(fd, PARTIALMAGIC, key, errorSums) || fclose(fd) != 0) {
+        printf("Cannot write partial result file '%s'\n", filename);
+        exit(1);
+    }
+}
+
+
+// Merge partial result files and print the error table
+static void
+mergePartials(int numFiles, char** filenames)
+{
+    ErrorSums* parts = (ErrorSums *) malloc(numFiles * sizeof(ErrorSums));
+    unsigned long long key = 0;
+    int i, c;
+
+    if (numFiles == 0) {
+        printf("merge needs partial result files\n");
+        exit(1);
+    }
+    for (i = 0; i < numFiles; i++) {
+        FILE* fd = fopen(filenames[i], "rb");
+        if (!fd) {
+            printf("cannot open file '%s'\n", filenames[i]);
+            exit(1);
+        }
+        if (!readErrorSums(fd, PARTIALMAGIC, &key, &parts[i])) {
+            printf("'%s' is not a partial result file of the same run as '%s'\n", filenames[i],
+                   filenames[0]);
+            exit(1);
+        }
+        fclose(fd);
+    }
+
+    // The ranges must cover all trials exactly once
+    std::sort(parts, parts + numFiles, [](const ErrorSums& a, const ErrorSums& b) {
+        return a.trialBegin < b.trialBegin;
+    });
+    const ErrorSums& first = parts[0];
+    int expectedBegin = 0;
+    for (i = 0; i < numFiles; i++) {
+        if (parts[i].numSamples != first.numSamples || parts[i].numTrials != first.numTrials ||
+            parts[i].numCounts != first.numCounts || parts[i].trialBegin != expectedBegin) {
+            printf("The partial results do not cover trials 0 .. %i once each\n",
+                   first.numTrials - 1);
+            exit(1);
+        }
+        expectedBegin = parts[i].trialEnd;
+    }
+    if (expectedBegin != first.numTrials) {
+        printf("The partial results do not cover trials 0 .. %i once each\n", first.numTrials - 1);
+        exit(1);
+    }
+
+    for (c = 0; c < first.numCounts; c++) {
+        ExactSum sum = 0;
+        double outside = 0.0;
+        for (i = 0; i < numFiles; i++) {
+            sum += parts[i].sums[c];
+            outside += parts[i].outside[c];
+        }
+        printError((c+1) * OUTPUTINTERVAL, (fromExactSum(sum) + outside) / first.numTrials);
+    }
+    fflush(stdout);
+
+    free(parts);
+}
+
+
+//
+// NUMA placement.
+//
+// With --numa the worker threads are pinned to CPUs, ordered by NUMA node (from
+// /sys/devices/system/node) so that consecutive threads share a node, and parallelForSequences
+// gives each thread a fixed contiguous block of sequences instead of handing them out one at
+// a time.  Before the sample file is read, each thread writes zeros to the sample table rows of
+// its block, so the pages of the rows are allocated on the node of the thread that later
+// evaluates them (first-touch placement).  For the main error table the rows go to the thread
+// of the run of trial tiles the sequence starts in (see mainLoopSplit).  --pair, --adaptive,
+// verify and bench do not split the sequences into fixed blocks, so --numa is rejected there.
+//
+
+bool numaPlacement = false;
+int* threadCpus = NULL;   // CPU of each worker thread with --numa
+
+
+// Add the CPUs in a sysfs cpulist ("0-3,8-11") that are in allowed and not yet in cpus
+#ifdef __linux__
+static void
+addCpuList(const char* text, const cpu_set_t* allowed, bool* added, int* cpus, int* numCpus)
+{
+    const char* c = text;
+    while (*c) {
+        int first, last, length;
+        if (sscanf(c, "%i%n", &first, &length) != 1)
+            break;
+        c += length;
+        last = first;
+        if (*c == '-' && sscanf(c + 1, "%i%n", &last, &length) == 1)
+            c += 1 + length;
+        for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++) {
+            if (CPU_ISSET(cpu, allowed) && !added[cpu]) {
+                added[cpu] = true;
+                cpus[(*numCpus)++] = cpu;
+            }
+        }
+        if (*c == ',') c++;
+        else break;
+    }
+}
+#endif
+
+
+// Choose the CPUs of the worker threads: the allowed CPUs ordered by node
+static void
+initNumaPlacement()
+{
+#ifdef __linux__
+    cpu_set_t allowed;
+    bool added[CPU_SETSIZE] = { false };
+    int cpus[CPU_SETSIZE], numCpus = 0, numNodes = 0;
+    char filename[64], text[4096];
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        fprintf(stderr, "numa: cannot get the CPU affinity; threads are not pinned\n");
+        return;
+    }
+    for (int node = 0; node < 1024; node++) {
+        sprintf(filename, "/sys/devices/system/node/node%i/cpulist", node);
+        FILE* fd = fopen(filename, "r");
+        if (!fd) {
+            if (node > 0) break;
+            continue;
+        }
+        if (fgets(text, sizeof(text), fd)) {
+            int before = numCpus;
+            addCpuList(text, &allowed, added, cpus, &numCpus);
+            if (numCpus > before) numNodes++;
+        }
+        fclose(fd);
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {   // CPUs not listed under any node
+        if (CPU_ISSET(cpu, &allowed) && !added[cpu])
+            cpus[numCpus++] = cpu;
+    }
+    if (numCpus == 0)
+        return;
+
+    numThreads = MIN(numThreads, numCpus);
+    threadCpus = (int *) malloc(numThreads * sizeof(int));
+    for (int i = 0; i < numThreads; i++)
+        threadCpus[i] = cpus[i];
+    numaPlacement = true;
+    fprintf(stderr, "numa: %i threads pinned to CPUs on %i node%s\n", numThreads,
+            MAX(numNodes, 1), (numNodes > 1) ? "s" : "");
+#else
+    fprintf(stderr, "numa: thread pinning is only supported on Linux\n");
+#endif
+}
+
+
+// Pin the calling thread to the CPU of worker thread threadNum
+static void
+pinThread(int threadNum)
+{
+#ifdef __linux__
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(threadCpus[threadNum], &cpuSet);
+    sched_setaffinity(0, sizeof(cpuSet), &cpuSet);
+#endif
+}
+
+
+// Call func(t, threadNum) for every sequence t in 0 .. numSequences-1, spread over numThreads
+// threads.  Sequences are handed out one at a time so uneven sequence costs are balanced,
+// except with --numa, where thread i gets the i-th contiguous block of sequences.
+template <typename Func>
+static void
+parallelForSequences(int numSequences, Func func)
+{
+    int n = MIN(numThreads, numSequences);
+    std::atomic<int> nextSequence(0);
+    auto worker = [&](int threadNum) {
+        int t;
+        if (numaPlacement && n > 1) {
+            pinThread(threadNum);
+            int end = (int) ((long long) numSequences * (threadNum + 1) / n);
+            for (t = (int) ((long long) numSequences * threadNum / n); t < end; t++)
+                func(t, threadNum);
+            return;
+        }
+        while ((t = nextSequence++) < numSequences)
+            func(t, threadNum);
+    };
+
+    if (n <= 1) {
+        worker(0);
+        return;
+    }
+    std::thread* threads = new std::thread[n];
+    for (int i = 0; i < n; i++)
+        threads[i] = std::thread(worker, i);
+    for (int i = 0; i < n; i++)
+        threads[i].join();
+    delete [] threads;
+}
+
+
+// With --numa, allocate the pages of the sample table rows of each thread's block of sequences
+// on the thread's node, by writing them first from that thread
+static void
+firstTouchSamples(double* coords, int dim, int numSamples, int numSequences)
+{
+    const size_t rowLength = sampleRowLength(dim, numSamples);
+    if (!numaPlacement)
+        return;
+    parallelForSequences(numSequences, [&](int t, int) {
+        memset(coords + t * rowLength, 0, (size_t) numSamples * dim * sizeof(double));
+    });
+}
+
+
+// The same for the main loop: the rows of sequences sequenceBegin .. sequenceEnd-1 are
+// touched by the thread that evaluates the first trial of the sequence
+static void
+firstTouchTrialRows(double* coords, int dim, int numSamples, int sequenceBegin, int sequenceEnd,
+                    int numCopies, const MainLoopSplit* split)
+{
+    const size_t rowLength = sampleRowLength(dim, numSamples);
+    if (!numaPlacement)
+        return;
+    parallelForSequences(split->numThreads, [&](int thread, int) {
+        for (int t = sequenceBegin; t < sequenceEnd; t++)
+            if (mainLoopThread(split, (t - sequenceBegin) * numCopies) == thread)
+                memset(coords + t * rowLength, 0, (size_t) numSamples * dim * sizeof(double));
+    });
+}
+
+
+// Barrier for the threads of a parallelForSequences call with one sequence per thread
+struct ThreadBarrier {
+    int numThreads;
+    std::atomic<int> waiting;
+    std::atomic<int> generation;
+};
+
+static void
+initBarrier(ThreadBarrier* barrier, int numThreads)
+{
+    barrier->numThreads = numThreads;
+    barrier->waiting = 0;
+    barrier->generation = 0;
+}
+
+// Wait until all threads have called barrierWait
+static void
+barrierWait(ThreadBarrier* barrier)
+{
+    int generation = barrier->generation.load();
+    if (barrier->waiting.fetch_add(1) + 1 == barrier->numThreads) {
+        barrier->waiting = 0;
+        barrier->generation++;
+        return;
+    }
+    while (barrier->generation.load() == generation)
+        std::this_thread::yield();
+}
+
+
+//
+// Main error table.
+//
+// The error table of a function for sample counts 4, 8, 12, ... numSamples, averaged over
+// trials trialBegin .. trialEnd-1, continued from the counts in errorSums (from a checkpoint).
+// It is a template on the dimension D of the sample set, instantiated by withDimension.
+//
+
+// Parameters and state of the main error table
+struct MainTable {
+    int functionNumber;
+    double reference;
+    int numSamples;
+    int trialBegin, trialEnd;
+    bool exactOutput;               // print the exact sums (sharded runs)
+    MainLoopSplit split;
+    ErrorSums* errorSums;           // the counts done
+    double* sumresults;             // running sums of the trials
+    const char* checkpointFilename;
+    double checkpointInterval;
+    unsigned long long runKey;
+};
+
+
+template <int D>
+static void
+mainErrorTable(const MainTable* table)
+{
+    const int functionNumber = table->functionNumber, numSamples = table->numSamples;
+    const int trialBegin = table->trialBegin, trialEnd = table->trialEnd;
+    const int dim = sampleSet.dim;
+    const double reference = table->reference;
+    const bool exactOutput = table->exactOutput;
+    const MainLoopSplit split = table->split;
+    ErrorSums* errorSums = table->errorSums;
+    double* sumresults = table->sumresults;
+    const char* checkpointFilename = table->checkpointFilename;
+    const double checkpointInterval = table->checkpointInterval;
+    const unsigned long long runKey = table->runKey;
+    double lastCheckpointTime = wallTime();
+
+    // Loop over blocks of SAMPLETILE sample counts, and in each block over tiles of TRIALTILE
+    // sequences (aka. "trials"), split over the threads in runs of tiles.  Thread 0 adds the
+    // errors of the runs in order, prints and writes the checkpoints.
+    const int nt = split.numThreads, runTrials = split.runTrials;
+    double* runErrors = (double *) arenaAlloc((size_t) nt * runTrials * SAMPLETILE *
+                                              sizeof(double));
+    double* threadValues = (double *) arenaAlloc((size_t) nt * SAMPLETILE * TRIALTILE *
+                                                 sizeof(double));
+    double* threadXs = (double *) arenaAlloc((size_t) nt * dim * TRIALTILE * sizeof(double));
+    ExactSum* threadExact = (ExactSum *) arenaAlloc(nt * SAMPLETILE * sizeof(ExactSum));
+    ThreadBarrier barrier;
+    initBarrier(&barrier, nt);
+    parallelForSequences(nt, [&](int thread, int) {
+        double* errors = runErrors + (size_t) thread * runTrials * SAMPLETILE;
+        double* values = threadValues + (size_t) thread * SAMPLETILE * TRIALTILE;
+        double* x[NDMAXDIM];
+        for (int d = 0; d < dim; d++)
+            x[d] = threadXs + ((size_t) thread * dim + d) * TRIALTILE;
+        ExactSum* exactErrors = threadExact + thread * SAMPLETILE;
+        for (int s0 = errorSums->numCounts * OUTPUTINTERVAL; s0 < numSamples; s0 += SAMPLETILE) {
+            int s1 = MIN(s0 + SAMPLETILE, numSamples);
+            double plainErrors[SAMPLETILE] = { 0.0 }, squaredErrors[SAMPLETILE] = { 0.0 };
+            double outsideErrors[SAMPLETILE] = { 0.0 };
+            for (int c = 0; c < SAMPLETILE; c++)
+                exactErrors[c] = 0;
+            for (int r0 = trialBegin; r0 < trialEnd; r0 += nt * runTrials) {
+                // The run of this thread
+                int t1 = MIN(r0 + (thread + 1) * runTrials, trialEnd);
+                for (int t0 = r0 + thread * runTrials; t0 < t1; t0 += TRIALTILE) {
+                    int n = MIN(TRIALTILE, t1 - t0);
+                    double* tileErrors = errors + (t0 - r0 - thread * runTrials) * SAMPLETILE;
+                    for (int s = s0; s < s1; s++)
+                        trialValues<D>(functionNumber, s, t0, n, x, values + (s - s0) * TRIALTILE);
+                    if (exactOutput)
+                        accumulateTile<true>(values, n, s0, s1, reference, sumresults + t0,
+                                             tileErrors, exactErrors);
+                    else
+                        accumulateTile<false>(values, n, s0, s1, reference, sumresults + t0,
+                                              tileErrors, exactErrors);
+                }
+                barrierWait(&barrier);
+                if (thread == 0) {
+                    for (int k = 0; k < nt; k++) {
+                        int n = MIN(r0 + (k + 1) * runTrials, trialEnd) - (r0 + k * runTrials);
+                        const double* e = runErrors + (size_t) k * runTrials * SAMPLETILE;
+                        if (n <= 0)
+                            break;
+                        if (exactOutput)
+                            addTileErrors<true>(e, n, s1 - s0, plainErrors, squaredErrors,
+                                                outsideErrors);
+                        else
+                            addTileErrors<false>(e, n, s1 - s0, plainErrors, squaredErrors,
+                                                 outsideErrors);
+                    }
+                }
+                barrierWait(&barrier);
+            }
+            if (thread != 0) {
+                barrierWait(&barrier);   // until thread 0 has read the exact sums
+                continue;
+            }
+
+            // Print error for 4, 8, 12, 16, ... samples
+            for (int s = s0; s < s1; s++) {
+                if ((s+1) % OUTPUTINTERVAL != 0) continue;
+                ExactSum exact = 0;
+                for (int k = 0; k < nt; k++)
+                    exact += threadExact[k * SAMPLETILE + (s - s0)];
+                double sum = exactOutput ? fromExactSum(exact) + outsideErrors[s - s0]
+                                         : plainErrors[s - s0];
+                printError(s+1, sum / (trialEnd - trialBegin));
+                errorSums->plain[errorSums->numCounts] = plainErrors[s - s0];
+                errorSums->sums[errorSums->numCounts] = exact;
+                errorSums->outside[errorSums->numCounts] = outsideErrors[s - s0];
+                errorSums->squares[errorSums->numCounts] = squaredErrors[s - s0];
+                errorSums->numCounts++;
+            }
+            fflush(stdout);
+
+            // The running sums are those of sample count s1, which is a printed count except at
+            // the end
+            if (checkpointFilename && s1 % OUTPUTINTERVAL == 0 &&
+                wallTime() - lastCheckpointTime >= checkpointInterval) {
+                writeCheckpoint(checkpointFilename, runKey, errorSums, sumresults);
+                lastCheckpointTime = wallTime();
+            }
+            barrierWait(&barrier);
+        }
+    });
+}
+
+
+//
+// Discrepancy of the sample sequences.
+//
+// The L2-star discrepancy T of the first N points is computed with Warnock's formula:
+//   T^2 = 1/9 - 1/(2N) sum_i (1-x_i^2)(1-y_i^2)
+//             + 1/N^2 sum_i sum_j (1-max(x_i,x_j)) (1-max(y_i,y_j))
+// With a = 1-x and b = 1-y the double sum is sum_i sum_j min(a_i,a_j) min(b_i,b_j).  The
+// contribution of point n to the double sum of all larger prefixes is a_n b_n + 2 P_n, where
+// P_n = sum_{j<n} min(a_n,a_j) min(b_n,b_j), so all prefixes come from one pass over P.
+//
+// The L-infinity star discrepancy is approximated on a DISCGRID x DISCGRID grid of anchored
+// boxes [0,u)x[0,v).  The grid boxes give a lower bound, and bracketing each box between grid
+// lines gives an upper bound; the two differ by at most about 2/DISCGRID.
+//
+
+#define DISCGRID 64            // resolution of the grid for the L-infinity star discrepancy
+#define DISCFASTSAMPLES 512    // use the O(N log^2 N) pair sums above this many samples
+#define DISCDIRECTCUTOFF 32    // block size below which the fast pair sums go direct
+
+
+// Compute P_n = sum_{j<n} min(a_n,a_j) min(b_n,b_j) directly.  O(N^2), but the inner loop
+// is branch-free and vectorizes.
+static void
+discrepancyPairSumsDirect(const double* a, const double* b, int n, double* pairSums)
+{
+    for (int i = 0; i < n; i++) {
+        const double ai = a[i], bi = b[i];
+        double sum = 0.0;
+        for (int j = 0; j < i; j++)
+            sum += MIN(ai, a[j]) * MIN(bi, b[j]);
+        pairSums[i] = sum;
+    }
+}
+
+
+// Workspace for the fast pair sums
+typedef struct DiscrepancyWork {
+    int* left;          // left half indices sorted by a
+    int* right;         // right half indices sorted by a
+    double* sortedB;    // b values of left half, sorted
+    double* prefixB;    // prefix sums of sortedB
+    double* bitCount;   // Fenwick trees over the ranks of sortedB
+    double* bitB;
+    double* bitA;
+    double* bitAB;
+} DiscrepancyWork;
+
+
+static inline void
+fenwickAdd(double* tree, int m, int pos, double value)
+{
+    for (pos++; pos <= m; pos += pos & -pos)
+        tree[pos-1] += value;
+}
+
+
+// Sum of the first k entries of a Fenwick tree
+static inline double
+fenwickSum(const double* tree, int k)
+{
+    double sum = 0.0;
+    for (; k > 0; k -= k & -k)
+        sum += tree[k-1];
+    return sum;
+}
+
+
+// Add the contributions of points [lo,mid) to P_n of points n in [mid,hi).
+// Sweeping the right half in order of increasing a, left points with a_j < a_n are inserted
+// in Fenwick trees indexed by the rank of b_j; the rest have min(a_n,a_j) = a_n.
+static void
+discrepancyCrossSums(const double* a, const double* b, int lo, int mid, int hi,
+                     double* pairSums, DiscrepancyWork* work)
+{
+    int m = mid - lo, r = hi - mid;
+    int *left = work->left, *right = work->right;
+    int i, k, p;
+
+    for (i = 0; i < m; i++) {
+        left[i] = lo + i;
+        work->sortedB[i] = b[lo + i];
+    }
+    for (i = 0; i < r; i++) right[i] = mid + i;
+    std::sort(left, left + m, [a](int i0, int i1) { return a[i0] < a[i1]; });
+    std::sort(right, right + r, [a](int i0, int i1) { return a[i0] < a[i1]; });
+    std::sort(work->sortedB, work->sortedB + m);
+
+    work->prefixB[0] = 0.0;
+    for (i = 0; i < m; i++) {
+        work->prefixB[i+1] = work->prefixB[i] + work->sortedB[i];
+        work->bitCount[i] = work->bitB[i] = work->bitA[i] = work->bitAB[i] = 0.0;
+    }
+
+    double countL = 0.0, sumAL = 0.0;   // totals of the inserted points
+    p = 0;
+    for (i = 0; i < r; i++) {
+        int n = right[i];
+        const double an = a[n], bn = b[n];
+
+        // Insert left points with a_j < a_n
+        while (p < m && a[left[p]] < an) {
+            int j = left[p++];
+            int rank = std::lower_bound(work->sortedB, work->sortedB + m, b[j]) - work->sortedB;
+            fenwickAdd(work->bitCount, m, rank, 1.0);
+            fenwickAdd(work->bitB, m, rank, b[j]);
+            fenwickAdd(work->bitA, m, rank, a[j]);
+            fenwickAdd(work->bitAB, m, rank, a[j] * b[j]);
+            countL += 1.0;
+            sumAL += a[j];
+        }
+
+        // k = number of left points with b_j < b_n
+        k = std::lower_bound(work->sortedB, work->sortedB + m, bn) - work->sortedB;
+        double countLlt = fenwickSum(work->bitCount, k);
+        double sumBLlt = fenwickSum(work->bitB, k);
+        double sumALge = sumAL - fenwickSum(work->bitA, k);
+        double sumABLlt = fenwickSum(work->bitAB, k);
+        double countHge = (m - k) - (countL - countLlt);
+        double sumBHlt = work->prefixB[k] - sumBLlt;
+
+        pairSums[n] += an * (bn * countHge + sumBHlt) + bn * sumALge + sumABLlt;
+    }
+}
+
+
+// Compute P_n for n in [lo,hi) by divide and conquer over the point index.  O(N log^2 N).
+static void
+discrepancyPairSumsRecursive(const double* a, const double* b, int lo, int hi,
+                             double* pairSums, DiscrepancyWork* work)
+{
+    if (hi - lo <= DISCDIRECTCUTOFF) {
+        for (int i = lo; i < hi; i++) {
+            const double ai = a[i], bi = b[i];
+            double sum = 0.0;
+            for (int j = lo; j < i; j++)
+                sum += MIN(ai, a[j]) * MIN(bi, b[j]);
+            pairSums[i] += sum;
+        }
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+    discrepancyPairSumsRecursive(a, b, lo, mid, pairSums, work);
+    discrepancyPairSumsRecursive(a, b, mid, hi, pairSums, work);
+    discrepancyCrossSums(a, b, lo, mid, hi, pairSums, work);
+}
+
+
+static void
+discrepancyPairSumsFast(const double* a, const double* b, int n, double* pairSums)
+{
+    DiscrepancyWork work;
+    work.left = (int *) malloc(n * sizeof(int));
+    work.right = (int *) malloc(n * sizeof(int));
+    work.sortedB = (double *) malloc(n * sizeof(double));
+    work.prefixB = (double *) malloc((n+1) * sizeof(double));
+    work.bitCount = (double *) malloc(n * sizeof(double));
+    work.bitB = (double *) malloc(n * sizeof(double));
+    work.bitA = (double *) malloc(n * sizeof(double));
+    work.bitAB = (double *) malloc(n * sizeof(double));
+
+    memset(pairSums, 0, n * sizeof(double));
+    discrepancyPairSumsRecursive(a, b, 0, n, pairSums, &work);
+
+    free(work.left); free(work.right);
+    free(work.sortedB); free(work.prefixB);
+    free(work.bitCount); free(work.bitB); free(work.bitA); free(work.bitAB);
+}
+
+
+// Compute the L2-star discrepancy and bounds on the L-infinity star discrepancy of
+// every output prefix of sequence t
+static void
+sequenceDiscrepancy(int t, int numSamples, double* l2star, double* linfLower, double* linfUpper)
+{
+    double* a = (double *) malloc(numSamples * sizeof(double));
+    double* b = (double *) malloc(numSamples * sizeof(double));
+    double* pairSums = (double *) malloc(numSamples * sizeof(double));
+    int* cellCounts = (int *) calloc(DISCGRID * DISCGRID, sizeof(int));
+    int* boxCounts = (int *) malloc((DISCGRID+1) * (DISCGRID+1) * sizeof(int));
+    int s, i, j, c = 0;
+
+    for (s = 0; s < numSamples; s++) {
+        a[s] = 1.0 - samplePoints[t][s].x;
+        b[s] = 1.0 - samplePoints[t][s].y;
+    }
+    if (numSamples > DISCFASTSAMPLES)
+        discrepancyPairSumsFast(a, b, numSamples, pairSums);
+    else
+        discrepancyPairSumsDirect(a, b, numSamples, pairSums);
+
+    double sumProd = 0.0, sumPairs = 0.0;
+    for (s = 0; s < numSamples; s++) {
+        double x = samplePoints[t][s].x, y = samplePoints[t][s].y;
+        sumProd += (1.0 - x*x) * (1.0 - y*y);
+        sumPairs += a[s] * b[s] + 2.0 * pairSums[s];
+
+        i = MIN(MAX((int)(x * DISCGRID), 0), DISCGRID-1);
+        j = MIN(MAX((int)(y * DISCGRID), 0), DISCGRID-1);
+        cellCounts[j * DISCGRID + i]++;
+
+        if ((s+1) % OUTPUTINTERVAL) continue;
+
+        // L2-star discrepancy of the first s+1 points
+        double n = s+1;
+        double t2 = 1.0/9.0 - sumProd / (2.0 * n) + sumPairs / (n * n);
+        l2star[c] = sqrt(MAX(t2, 0.0));
+
+        // boxCounts[j][i] = number of points in [0,i/G) x [0,j/G)
+        for (i = 0; i <= DISCGRID; i++) boxCounts[i] = 0;
+        for (j = 1; j <= DISCGRID; j++) {
+            int rowSum = 0;
+            boxCounts[j * (DISCGRID+1)] = 0;
+            for (i = 1; i <= DISCGRID; i++) {
+                rowSum += cellCounts[(j-1) * DISCGRID + (i-1)];
+                boxCounts[j * (DISCGRID+1) + i] = boxCounts[(j-1) * (DISCGRID+1) + i] + rowSum;
+            }
+        }
+
+        // Grid boxes give the lower bound; boxes between grid lines the upper bound
+        double lower = 0.0, upper = 0.0;
+        const double invN = 1.0 / n, invG2 = 1.0 / (DISCGRID * DISCGRID);
+        for (j = 0; j <= DISCGRID; j++) {
+            for (i = 0; i <= DISCGRID; i++) {
+                double local = boxCounts[j * (DISCGRID+1) + i] * invN - i * j * invG2;
+                lower = MAX(lower, fabs(local));
+                if (i < DISCGRID && j < DISCGRID) {
+                    double over = boxCounts[(j+1) * (DISCGRID+1) + (i+1)] * invN - i * j * invG2;
+                    double under = (i+1) * (j+1) * invG2 - boxCounts[j * (DISCGRID+1) + i] * invN;
+                    upper = MAX(upper, MAX(over, under));
+                }
+            }
+        }
+        linfLower[c] = lower;
+        linfUpper[c] = upper;
+        c++;
+    }
+
+    free(a); free(b); free(pairSums);
+    free(cellCounts); free(boxCounts);
+}
+
+
+// Print average discrepancies over all sequences for sample counts 4, 8, 12, ... numSamples.
+// Each line is: sample count, L2-star, L-infinity star lower bound and upper bound.
+static void
+discrepancyTable(int numSamples, int numSequences)
+{
+    int numCounts = numSamples / OUTPUTINTERVAL;
+    const size_t n = (size_t) numSequences * numCounts;
+    double* l2star = (double *) arenaAlloc(n * sizeof(double));
+    double* linfLower = (double *) arenaAlloc(n * sizeof(double));
+    double* linfUpper = (double *) arenaAlloc(n * sizeof(double));
+
+    parallelForSequences(numSequences, [&](int t, int) {
+        sequenceDiscrepancy(t, numSamples, l2star + t * numCounts,
+                            linfLower + t * numCounts, linfUpper + t * numCounts);
+    });
+
+    for (int c = 0; c < numCounts; c++) {
+        double sumL2 = 0.0, sumLower = 0.0, sumUpper = 0.0;
+        for (int t = 0; t < numSequences; t++) {
+            sumL2 += l2star[t * numCounts + c];
+            sumLower += linfLower[t * numCounts + c];
+            sumUpper += linfUpper[t * numCounts + c];
+        }
+        printf("%i %f %f %f\n", (c+1) * OUTPUTINTERVAL, sumL2 / numSequences,
+               sumLower / numSequences, sumUpper / numSequences);
+    }
+    fflush(stdout);
+}
+
+
+//
+// Power spectrum of the sample sequences.
+//
+// The first N points of each sequence are splatted onto a SPECTRUMRES x SPECTRUMRES grid and
+// the periodogram |F(k)|^2 / N of the grid is computed with an FFT.  The periodograms are
+// averaged over all sequences, so uniform random points give an expected power of 1 at every
+// frequency except DC.  This is done for N = 16, 32, 64, ... and numSamples.
+//
+
+#define SPECTRUMRES 256        // grid resolution; must be a power of two
+#define SPECTRUMMINSAMPLES 16  // smallest prefix that a spectrum is computed for
+
+
+// In-place radix-2 FFT of n complex values (re, im) with the given stride.  cosTable and
+// sinTable hold cos and -sin of 2 pi k/n for k < n/2.
+static void
+fft(double* re, double* im, int n, int stride, const double* cosTable, const double* sinTable)
+{
+    int i, j, k, len;
+
+    // Bit-reversal permutation
+    for (i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j) {
+            double tr = re[i*stride], ti = im[i*stride];
+            re[i*stride] = re[j*stride]; im[i*stride] = im[j*stride];
+            re[j*stride] = tr; im[j*stride] = ti;
+        }
+    }
+
+    // Butterflies
+    for (len = 2; len <= n; len <<= 1) {
+        int half = len >> 1, step = n / len;
+        for (i = 0; i < n; i += len) {
+            for (k = 0; k < half; k++) {
+                double wr = cosTable[k*step], wi = sinTable[k*step];
+                int p = (i + k) * stride, q = (i + k + half) * stride;
+                double xr = re[q] * wr - im[q] * wi;
+                double xi = re[q] * wi + im[q] * wr;
+                re[q] = re[p] - xr; im[q] = im[p] - xi;
+                re[p] += xr; im[p] += xi;
+            }
+        }
+    }
+}
+
+
+// Add the periodogram of the first n points of sequence t to power[]
+static void
+sequencePeriodogram(int t, int n, double* re, double* im, double* power,
+                    const double* cosTable, const double* sinTable)
+{
+    const int res = SPECTRUMRES;
+    int i, j, s;
+
+    memset(re, 0, res * res * sizeof(double));
+    memset(im, 0, res * res * sizeof(double));
+    for (s = 0; s < n; s++) {
+        i = MIN(MAX((int)(samplePoints[t][s].x * res), 0), res-1);
+        j = MIN(MAX((int)(samplePoints[t][s].y * res), 0), res-1);
+        re[j * res + i] += 1.0;
+    }
+
+    for (j = 0; j < res; j++)   // rows
+        fft(re + j * res, im + j * res, res, 1, cosTable, sinTable);
+    for (i = 0; i < res; i++)   // columns
+        fft(re + i, im + i, res, res, cosTable, sinTable);
+
+    const double invN = 1.0 / n;
+    for (i = 0; i < res * res; i++)
+        power[i] += (re[i] * re[i] + im[i] * im[i]) * invN;
+}
+
+
+// Write a power spectrum with DC in the center as a grayscale PFM image
+static void
+writeSpectrumImage(const char* filename, const double* power)
+{
+    const int res = SPECTRUMRES;
+    FILE* fd = fopen(filename, "wb");
+    if (!fd) {
+        printf("cannot open file '%s'\n", filename);
+        exit(1);
+    }
+    // The floats are written in native order, so the scale sign declares the host byte order
+    fprintf(fd, "Pf\n%i %i\n%s\n", res, res, littleEndianHost() ? "-1.0" : "1.0");
+    float* row = (float *) malloc(res * sizeof(float));
+    for (int j = 0; j < res; j++) {
+        int fj = (j + res/2) % res;
+        for (int i = 0; i < res; i++)
+            row[i] = (float) power[fj * res + (i + res/2) % res];
+        fwrite(row, sizeof(float), res, fd);
+    }
+    free(row);
+    fclose(fd);
+}
+
+
+// Write the radially averaged power spectrum: one line per integer frequency 1 .. res/2
+static void
+writeRadialProfile(const char* filename, const double* power)
+{
+    const int res = SPECTRUMRES;
+    double sum[SPECTRUMRES/2 + 1];
+    int count[SPECTRUMRES/2 + 1];
+    int i, j, r;
+
+    for (r = 0; r <= res/2; r++) {
+        sum[r] = 0.0;
+        count[r] = 0;
+    }
+    for (j = 0; j < res; j++) {
+        int fy = (j <= res/2) ? j : j - res;
+        for (i = 0; i < res; i++) {
+            int fx = (i <= res/2) ? i : i - res;
+            r = (int) floor(sqrt((double)(fx*fx + fy*fy)) + 0.5);
+            if (r > res/2) continue;
+            sum[r] += power[j * res + i];
+            count[r]++;
+        }
+    }
+
+    FILE* fd = fopen(filename, "w");
+    if (!fd) {
+        printf("cannot open file '%s'\n", filename);
+        exit(1);
+    }
+    for (r = 1; r <= res/2; r++)
+        fprintf(fd, "%i %f\n", r, sum[r] / count[r]);
+    fclose(fd);
+}
+
+
+// Compute average power spectra of all sequences for N = 16, 32, ... numSamples and write
+// them as <base>_spectrum<N>.pfm images and <base>_radial<N>.data radial profiles, where
+// <base> is the samples filename without directory and extension.
+static void
+spectrumTables(const char* samplesFilename, int numSamples, int numSequences)
+{
+    const int res = SPECTRUMRES;
+    int counts[32], numCounts = 0;
+    int n, c, i;
+
+    for (n = SPECTRUMMINSAMPLES; n < numSamples; n *= 2)
+        counts[numCounts++] = n;
+    counts[numCounts++] = numSamples;
+
+    double cosTable[SPECTRUMRES/2], sinTable[SPECTRUMRES/2];
+    for (i = 0; i < res/2; i++) {
+        cosTable[i] = cos(2.0 * M_PI * i / res);
+        sinTable[i] = -sin(2.0 * M_PI * i / res);
+    }
+
+    // Per-thread work grids and power sums
+    int nt = MAX(MIN(numThreads, numSequences), 1);
+    double* re = (double *) malloc(nt * res * res * sizeof(double));
+    double* im = (double *) malloc(nt * res * res * sizeof(double));
+    double* power = (double *) arenaAlloc((size_t) nt * numCounts * res * res *
+                                          sizeof(double));
+
+    parallelForSequences(numSequences, [&](int t, int threadNum) {
+        for (int c = 0; c < numCounts; c++)
+            sequencePeriodogram(t, counts[c], re + threadNum * res * res,
+                                im + threadNum * res * res,
+                                power + ((size_t) threadNum * numCounts + c) * res * res,
+                                cosTable, sinTable);
+    });
+
+    // Filename base: strip directory and extension
+    char base[1024];
+    const char* slash = strrchr(samplesFilename, '/');
+    snprintf(base, sizeof(base), "%s", slash ? slash + 1 : samplesFilename);
+    char* dot = strrchr(base, '.');
+    if (dot) *dot = '\0';
+
+    for (c = 0; c < numCounts; c++) {
+        double* sum = power + (size_t) c * res * res;   // thread 0's sum
+        for (int k = 1; k < nt; k++)
+            for (i = 0; i < res * res; i++)
+                sum[i] += power[((size_t) k * numCounts + c) * res * res + i];
+        for (i = 0; i < res * res; i++)
+            sum[i] /= numSequences;
+
+        char imageFilename[1100], radialFilename[1100];
+        snprintf(imageFilename, sizeof(imageFilename), "%s_spectrum%i.pfm", base, counts[c]);
+        snprintf(radialFilename, sizeof(radialFilename), "%s_radial%i.data", base, counts[c]);
+        writeSpectrumImage(imageFilename, sum);
+        writeRadialProfile(radialFilename, sum);
+        printf("%i %s %s\n", counts[c], imageFilename, radialFilename);
+    }
+    fflush(stdout);
+
+    free(re); free(im);
+}
+
+
+//
+// Randomized integrand families.
+//
+// Instead of one fixed integrand, each sequence is used to integrate numInstances random
+// instances of a family of integrands, each with an analytic reference value.  The error
+// is averaged over all instances and sequences, so samplers that happen to be aligned with
+// one particular discontinuity do not get an unfair advantage.
+// The parameters are stored as structure-of-arrays and evaluated in tiles of FAMILYTILE
+// instances.  The parameters and running sums of a tile stay in the L1 cache while the tile
+// sweeps over all samples of a sequence, and the loop over the instances of a tile vectorizes,
+// so the evaluation stays compute-bound no matter how many instances there are.
+//
+
+#define NUMFAMILIES 3
+#define FAMILYTILE 256   // instances per tile: 6 arrays of 256 doubles = 12 KB
+
+enum FamilyType { RANDOMDISKS, RANDOMHALFPLANES, RANDOMGAUSSIANS };
+
+const char* familyNames[NUMFAMILIES] = { "randomdisks", "randomhalfplanes", "randomgaussians" };
+
+typedef struct IntegrandFamily {
+    int type;
+    int numInstances;
+    // Disks: center (p0,p1), squared radius p2.
+    // Half-planes: 1 where p0*x + p1*y < p2.
+    // Gaussians: center (p0,p1), 1/(2 sigma_x^2) p2, 1/(2 sigma_y^2) p3.
+    double *p0, *p1, *p2, *p3;
+    double *refValues;
+} IntegrandFamily;
+
+
+// Area of the part of the unit square where nx*x + ny*y < d.  The square is clipped
+// against the half-plane and the area of the resulting polygon is computed.
+static double
+halfPlaneArea(double nx, double ny, double d)
+{
+    const double square[4][2] = { {0,0}, {1,0}, {1,1}, {0,1} };
+    double poly[8][2];
+    int n = 0;
+
+    for (int k = 0; k < 4; k++) {
+        const double* p = square[k];
+        const double* q = square[(k+1) % 4];
+        double dp = nx * p[0] + ny * p[1] - d;
+        double dq = nx * q[0] + ny * q[1] - d;
+        if (dp < 0.0) {
+            poly[n][0] = p[0]; poly[n][1] = p[1]; n++;
+        }
+        if ((dp < 0.0) != (dq < 0.0)) {
+            double u = dp / (dp - dq);
+            poly[n][0] = p[0] + u * (q[0] - p[0]);
+            poly[n][1] = p[1] + u * (q[1] - p[1]);
+            n++;
+        }
+    }
+
+    double area = 0.0;
+    for (int k = 0; k < n; k++)
+        area += poly[k][0] * poly[(k+1) % n][1] - poly[(k+1) % n][0] * poly[k][1];
+    return 0.5 * fabs(area);
+}
+
+
+// Integral of exp(-(x-c)^2 / (2 sigma^2)) over [0,1]
+static double
+gaussianIntegral1D(double c, double sigma)
+{
+    double s = sigma * sqrt(2.0);
+    return 0.5 * sqrt(M_PI) * s * (erf((1.0 - c) / s) + erf(c / s));
+}
+
+
+// Generate numInstances random integrands of the given family type
+static void
+initIntegrandFamily(IntegrandFamily* family, int type, int numInstances, long seed)
+{
+    // Pad to whole tiles with instances that are 0 everywhere and have reference value 0
+    int numPadded = (numInstances + FAMILYTILE-1) / FAMILYTILE * FAMILYTILE;
+
+    family->type = type;
+    family->numInstances = numInstances;
+    family->p0 = (double *) malloc(numPadded * sizeof(double));
+    family->p1 = (double *) malloc(numPadded * sizeof(double));
+    family->p2 = (double *) malloc(numPadded * sizeof(double));
+    family->p3 = (double *) malloc(numPadded * sizeof(double));
+    family->refValues = (double *) malloc(numPadded * sizeof(double));
+    for (int k = numInstances; k < numPadded; k++) {
+        family->p0[k] = (type == RANDOMHALFPLANES) ? 0.0 : 1000.0;
+        family->p1[k] = 0.0;
+        family->p2[k] = (type == RANDOMHALFPLANES) ? -1.0 : 1.0;
+        family->p3[k] = 1.0;
+        family->refValues[k] = 0.0;
+    }
+
+    srand48(seed);
+    for (int k = 0; k < numInstances; k++) {
+        switch (type) {
+        case RANDOMDISKS: {
+            // Disk inside the unit square with radius between 0.05 and 0.45
+            double r = 0.05 + 0.4 * uniformrandom();
+            family->p0[k] = r + (1.0 - 2.0*r) * uniformrandom();
+            family->p1[k] = r + (1.0 - 2.0*r) * uniformrandom();
+            family->p2[k] = r * r;
+            family->p3[k] = 0.0;
+            family->refValues[k] = M_PI * r * r;
+            break;
+        }
+        case RANDOMHALFPLANES: {
+            // Line with random direction through a random point in the unit square
+            double angle = 2.0 * M_PI * uniformrandom();
+            double nx = cos(angle), ny = sin(angle);
+            double d = nx * uniformrandom() + ny * uniformrandom();
+            family->p0[k] = nx;
+            family->p1[k] = ny;
+            family->p2[k] = d;
+            family->p3[k] = 0.0;
+            family->refValues[k] = halfPlaneArea(nx, ny, d);
+            break;
+        }
+        case RANDOMGAUSSIANS: {
+            // Random center and independent widths between 0.05 and 0.5 in x and y
+            double cx = uniformrandom(), cy = uniformrandom();
+            double sx = 0.05 + 0.45 * uniformrandom(), sy = 0.05 + 0.45 * uniformrandom();
+            family->p0[k] = cx;
+            family->p1[k] = cy;
+            family->p2[k] = 1.0 / (2.0 * sx * sx);
+            family->p3[k] = 1.0 / (2.0 * sy * sy);
+            family->refValues[k] = gaussianIntegral1D(cx, sx) * gaussianIntegral1D(cy, sy);
+            break;
+        }
+        }
+    }
+}
+
+
+static void
+freeIntegrandFamily(IntegrandFamily* family)
+{
+    free(family->p0); free(family->p1); free(family->p2); free(family->p3);
+    free(family->refValues);
+}
+
+
+// Evaluate the tile of instances [k0, k0 + FAMILYTILE) at the first numSamples points (xs, ys)
+// and add the absolute errors at sample counts 4, 8, 12, ... to errorSums[]
+template <int Type>
+static void
+familyTileErrors(const IntegrandFamily* family, int k0, const double* __restrict xs,
+                 const double* __restrict ys, int numSamples, double* __restrict sum,
+                 double* __restrict errorSums)
+{
+    const double* __restrict p0 = family->p0 + k0;
+    const double* __restrict p1 = family->p1 + k0;
+    const double* __restrict p2 = family->p2 + k0;
+    const double* __restrict p3 = family->p3 + k0;
+    const double* __restrict ref = family->refValues + k0;
+    int k, s;
+
+    for (k = 0; k < FAMILYTILE; k++)
+        sum[k] = 0.0;
+
+    for (s = 0; s < numSamples; s++) {
+        const double x = xs[s], y = ys[s];
+        for (k = 0; k < FAMILYTILE; k++) {
+            if (Type == RANDOMDISKS) {
+                double dx = x - p0[k], dy = y - p1[k];
+                sum[k] += (dx*dx + dy*dy < p2[k]) ? 1.0 : 0.0;
+            } else if (Type == RANDOMHALFPLANES) {
+                sum[k] += (p0[k] * x + p1[k] * y < p2[k]) ? 1.0 : 0.0;
+            } else {
+                double dx = x - p0[k], dy = y - p1[k];
+                sum[k] += exp(-dx*dx * p2[k] - dy*dy * p3[k]);
+            }
+        }
+
+        if ((s+1) % OUTPUTINTERVAL) continue;
+        const double invN = 1.0 / (s+1);
+        double error = 0.0;
+        for (k = 0; k < FAMILYTILE; k++)
+            error += fabs(sum[k] * invN - ref[k]);
+        errorSums[(s+1) / OUTPUTINTERVAL - 1] += error;
+    }
+}
+
+
+// Print the error averaged over all sequences and integrand instances for sample counts
+// 4, 8, 12, ... numSamples
+static void
+familyErrorTable(const IntegrandFamily* family, int numSamples, int numTrials)
+{
+    const int m = family->numInstances;
+    int numCounts = numSamples / OUTPUTINTERVAL;
+    int nt = MAX(MIN(numThreads, numTrials), 1);
+    double* xs = (double *) malloc(nt * numSamples * sizeof(double));
+    double* ys = (double *) malloc(nt * numSamples * sizeof(double));
+    double* sumerror = (double *) arenaAlloc(nt * numCounts * sizeof(double));
+
+    double* sums = (double *) arenaAlloc(nt * FAMILYTILE * sizeof(double));
+
+    parallelForSequences(numTrials, [&](int t, int threadNum) {
+        double* sum = sums + threadNum * FAMILYTILE;
+        double* x = xs + threadNum * numSamples;
+        double* y = ys + threadNum * numSamples;
+        double* threadError = sumerror + threadNum * numCounts;
+        double* const xy[2] = { x, y };
+        gatherSequence<2>(&sampleSet, t, numSamples, xy);
+        for (int k0 = 0; k0 < m; k0 += FAMILYTILE) {
+            switch (family->type) {
+            case RANDOMDISKS:
+                familyTileErrors<RANDOMDISKS>(family, k0, x, y, numSamples, sum, threadError);
+                break;
+            case RANDOMHALFPLANES:
+                familyTileErrors<RANDOMHALFPLANES>(family, k0, x, y, numSamples, sum, threadError);
+                break;
+            case RANDOMGAUSSIANS:
+                familyTileErrors<RANDOMGAUSSIANS>(family, k0, x, y, numSamples, sum, threadError);
+                break;
+            }
+        }
+    });
+
+    for (int c = 0; c < numCounts; c++) {
+        double error = 0.0;
+        for (int k = 0; k < nt; k++)
+            error += sumerror[k * numCounts + c];
+        printError((c+1) * OUTPUTINTERVAL, error / ((double) numTrials * m));
+    }
+    fflush(stdout);
+
+    free(xs);
+    free(ys);
+}
+
+
+//
+// Errors of sub-ranges of the sequences.
+//
+// The function is evaluated once at every sample point, and the prefix sums of the values
+// of each sequence are stored, so the estimate from samples [k, k+N) is the O(1) difference
+// (prefix[k+N] - prefix[k]) / N.  This gives the errors for many offsets k and lengths N
+// without evaluating the function again.
+//
+
+// Print the average error of samples [k, k+N) for offsets k = 0, offsetStep, 2*offsetStep, ...
+// and lengths N = 4, 8, 12, ... numSamples-k.  Each line is: offset, length, error.  The
+// offsets are separated by blank lines (one gnuplot data block per offset).
+template <int D>
+static void
+subrangeErrorTable(int functionNumber, double reference, int numSamples, int numTrials,
+                   int offsetStep)
+{
+    const size_t stride = numSamples + 1;
+    const int dim = sampleSet.dim;
+    double* prefix = (double *) arenaAlloc(numTrials * stride * sizeof(double));
+    int nt = MAX(MIN(numThreads, numTrials), 1);
+    double* coords = (double *) malloc((size_t) nt * dim * numSamples * sizeof(double));
+
+    // Evaluate all samples of each sequence and store the prefix sums of the values
+    parallelForSequences(numTrials, [&](int t, int threadNum) {
+        double* x[NDMAXDIM];
+        for (int d = 0; d < dim; d++)
+            x[d] = coords + ((size_t) threadNum * dim + d) * numSamples;
+        double* p = prefix + t * stride;
+        sequenceValues<D>(functionNumber, t, numSamples, x, p + 1);
+        p[0] = 0.0;
+        for (int s = 1; s <= numSamples; s++)
+            p[s] += p[s-1];
+    });
+
+    for (int k = 0; k < numSamples; k += offsetStep) {
+        if (k > 0) printf("\n");
+        for (int n = OUTPUTINTERVAL; k + n <= numSamples; n += OUTPUTINTERVAL) {
+            double sumerror = 0.0;
+            for (int t = 0; t < numTrials; t++) {
+                const double* p = prefix + t * stride;
+                sumerror += fabs((p[k+n] - p[k]) / n - reference);
+            }
+            printf("%i %i %f\n", k, n, sumerror / numTrials);
+        }
+    }
+    fflush(stdout);
+
+    free(coords);
+}
+
+
+//
+// Adaptive number of trials.
+//
+// The trials are evaluated in batches of ADAPTIVEBATCH.  After each batch the mean error and
+// its standard error (standard deviation of the per-trial errors / sqrt(number of trials))
+// are computed for every reported sample count, and the run stops when the standard error is
+// at most tolerance * mean error at all counts, or when all trials have been used.  The
+// trials are evaluated in parallel within a batch; the sums are accumulated in trial order,
+// so the result does not depend on the number of threads.
+//
+
+#define ADAPTIVEBATCH 32
+#define ADAPTIVEMINBATCHES 2
+
+// Print the average error for sample counts 4, 8, 12, ... numSamples using as many of the
+// numTrials trials as needed, preceded by a comment line with the number of trials used
+template <int D>
+static void
+adaptiveErrorTable(int functionNumber, double reference, int numSamples, int numTrials,
+                   double tolerance)
+{
+    const int numCounts = numSamples / OUTPUTINTERVAL;
+    double* errors = (double *) arenaAlloc(ADAPTIVEBATCH * numCounts * sizeof(double));
+    double* sumerror = (double *) arenaAlloc(numCounts * sizeof(double));
+    double* sumerror2 = (double *) arenaAlloc(numCounts * sizeof(double));
+    const int dim = sampleSet.dim;
+    int nt = MAX(MIN(numThreads, ADAPTIVEBATCH), 1);
+    double* coords = (double *) malloc((size_t) nt * dim * numSamples * sizeof(double));
+    double* values = (double *) malloc(nt * numSamples * sizeof(double));
+    double worst = 0.0;
+    int usedTrials = 0, batches = 0;
+
+    while (usedTrials < numTrials) {
+        int t0 = usedTrials, n = MIN(ADAPTIVEBATCH, numTrials - usedTrials);
+
+        // Errors of each trial in the batch at every reported count
+        parallelForSequences(n, [&](int k, int threadNum) {
+            double* x[NDMAXDIM];
+            for (int d = 0; d < dim; d++)
+                x[d] = coords + ((size_t) threadNum * dim + d) * numSamples;
+            double* v = values + threadNum * numSamples;
+            double sum = 0.0;
+            sequenceValues<D>(functionNumber, t0 + k, numSamples, x, v);
+            for (int s = 0; s < numSamples; s++) {
+                sum += v[s];
+                if ((s+1) % OUTPUTINTERVAL == 0)
+                    errors[k * numCounts + (s+1) / OUTPUTINTERVAL - 1] = fabs(sum / (s+1) - reference);
+            }
+        });
+        for (int k = 0; k < n; k++) {
+            for (int c = 0; c < numCounts; c++) {
+                double e = errors[k * numCounts + c];
+                sumerror[c] += e;
+                sumerror2[c] += e * e;
+            }
+        }
+        usedTrials += n;
+        batches++;
+        if (batches < ADAPTIVEMINBATCHES)
+            continue;
+
+        // Largest standard error relative to the mean error over all counts
+        worst = 0.0;
+        for (int c = 0; c < numCounts; c++) {
+            double mean = sumerror[c] / usedTrials;
+            double variance = MAX(sumerror2[c] / usedTrials - mean * mean, 0.0);
+            double stderror = sqrt(variance / (usedTrials - 1));
+            if (stderror > 0.0) {
+                double relative = (mean > 0.0) ? stderror / mean : HUGE_VAL;
+                worst = MAX(worst, relative);
+            }
+        }
+        if (worst <= tolerance)
+            break;
+    }
+
+    printf("# adaptive: %i of %i trials, max relative standard error %g (tolerance %g)\n",
+           usedTrials, numTrials, worst, tolerance);
+    for (int c = 0; c < numCounts; c++)
+        printError((c+1) * OUTPUTINTERVAL, sumerror[c] / usedTrials);
+    fflush(stdout);
+
+    free(coords);
+    free(values);
+}
+
+
+//
+// Four-dimensional integrands.
+//
+// With --pair, the points of a second sample file (or generator) are zipped with the points
+// of the first into 4D points (x0, x1, x2, x3).  For example sobol_dim01 and sobol_dim23
+// give the first four Sobol dimensions, and the errors show how well the two pairs of
+// dimensions are decorrelated.  The 4D integrands are:
+//   f*g        f(x0,x1) * g(x2,x3) for two named 2D functions f and g
+//   cross:f*g  f(x0,x2) * g(x1,x3): each factor depends on both sample sets
+//   ball4D     1 inside the 4D ball with center (0.5,0.5,0.5,0.5) and radius 0.5
+//   simplex4D  1 where x0 + x1 + x2 + x3 < 2
+// The 2D factors are evaluated with the same batch functions as in 2D.
+//
+
+enum Function4DType { F4PRODUCT, F4CROSS, F4BALL, F4SIMPLEX };
+
+typedef struct Function4D {
+    int type;
+    int f, g;            // function numbers of the factors of F4PRODUCT and F4CROSS
+    double refValue;
+} Function4D;
+
+
+// Function number of a named function, or -1
+static int
+findFunction(const char* name, size_t len)
+{
+    for (int i = 0; i < NUMFUNCTIONS; i++)
+        if (strlen(functionTable[i].name) == len && strncmp(name, functionTable[i].name, len) == 0)
+            return i;
+    return -1;
+}
+
+
+// Parse the name of a 4D function.  Returns false if it is unknown.
+static bool
+parseFunction4D(const char* name, Function4D* function)
+{
+    if (strcmp(name, "ball4D") == 0) {
+        function->type = F4BALL;
+        function->refValue = M_PI * M_PI / 32.0;   // pi^2/2 r^4 with r = 1/2
+        return true;
+    }
+    if (strcmp(name, "simplex4D") == 0) {
+        function->type = F4SIMPLEX;
+        function->refValue = 0.5;
+        return true;
+    }
+
+    function->type = F4PRODUCT;
+    if (strncmp(name, "cross:", 6) == 0) {
+        function->type = F4CROSS;
+        name += 6;
+    }
+    const char* star = strchr(name, '*');
+    if (!star) return false;
+    function->f = findFunction(name, star - name);
+    function->g = findFunction(star + 1, strlen(star + 1));
+    if (function->f < 0 || function->g < 0) return false;
+    function->refValue = functionTable[function->f].refValue * functionTable[function->g].refValue;
+    return true;
+}
+
+
+// Evaluate a 4D function at n points
+static void
+evaluateFunction4DBatch(const Function4D* function, const double* __restrict x0,
+                        const double* __restrict x1, const double* __restrict x2,
+                        const double* __restrict x3, double* __restrict out, int n)
+{
+    double values[EVALBATCH];
+    int k;
+
+    switch (function->type) {
+    case F4PRODUCT:
+        evaluateFunctionBatch(function->f, x0, x1, out, n);
+        evaluateFunctionBatch(function->g, x2, x3, values, n);
+        for (k = 0; k < n; k++) out[k] *= values[k];
+        break;
+    case F4CROSS:
+        evaluateFunctionBatch(function->f, x0, x2, out, n);
+        evaluateFunctionBatch(function->g, x1, x3, values, n);
+        for (k = 0; k < n; k++) out[k] *= values[k];
+        break;
+    case F4BALL:
+        for (k = 0; k < n; k++) {
+            double d0 = x0[k] - 0.5, d1 = x1[k] - 0.5, d2 = x2[k] - 0.5, d3 = x3[k] - 0.5;
+            out[k] = (d0*d0 + d1*d1 + d2*d2 + d3*d3 < 0.25) ? 1.0 : 0.0;
+        }
+        break;
+    case F4SIMPLEX:
+        for (k = 0; k < n; k++)
+            out[k] = (x0[k] + x1[k] + x2[k] + x3[k] < 2.0) ? 1.0 : 0.0;
+        break;
+    }
+}
+
+
+// Print the average error of a 4D function for sample counts 4, 8, 12, ... numSamples.
+// The same loop as for 2D functions, with the points zipped from two sample sets.
+static void
+errorTable4D(const Function4D* function, const SampleSet* set01, const SampleSet* set23,
+             int numSamples, int numTrials)
+{
+    double* sumresults = (double *) arenaAlloc(numTrials * sizeof(double));
+    double x0[EVALBATCH], x1[EVALBATCH], x2[EVALBATCH], x3[EVALBATCH], results[EVALBATCH];
+    double* const x01[2] = { x0, x1 };
+    double* const x23[2] = { x2, x3 };
+
+    for (int s = 0; s < numSamples; s++) {
+        double sumerror = 0.0;
+        for (int t0 = 0; t0 < numTrials; t0 += EVALBATCH) {
+            int n = MIN(EVALBATCH, numTrials - t0);
+            gatherTrials<2>(set01, s, t0, n, x01);
+            gatherTrials<2>(set23, s, t0, n, x23);
+            evaluateFunction4DBatch(function, x0, x1, x2, x3, results, n);
+            for (int t = 0; t < n; t++) {
+                sumresults[t0 + t] += results[t];
+                sumerror += fabs(sumresults[t0 + t] / (s+1) - function->refValue);
+            }
+        }
+
+        if ((s+1) % OUTPUTINTERVAL == 0) {
+            printError(s+1, sumerror / numTrials);
+            fflush(stdout);
+        }
+    }
+
+}
+
+
+//
+// Benchmark of the stages of a run.
+//
+// Times reading and parsing the sample file, gathering the points into the arrays used for
+// batch evaluation (the layout transform), reading the points from the sample table in the
+// order of the main loop without evaluating them (one row per sequence, so a stride of a
+// whole row between consecutive points), evaluating each of the functions in functionTable
+// at the gathered points one point at a time with evaluateFunctionAt() ("scalar") and in
+// batches with evaluateFunctionBatch() ("batch"), and formatting the error table.  Both
+// evaluation variants read the same contiguous arrays, so they differ only in the cost of
+// the evaluation.  Each stage is run
+// numRepeats times on one thread.  The output has one line per stage and variant with the
+// median and minimum time in seconds and the throughput (points or lines per second) based on
+// the median.
+//
+
+#define BENCHREPEATS 5
+
+double benchSink = 0.0;   // keeps the benchmarked evaluations from being optimized away
+
+
+// Print one benchmark result line
+static void
+printBenchLine(const char* stage, const char* name, const char* variant, double* times,
+               int numRepeats, double items)
+{
+    std::sort(times, times + numRepeats);
+    double median = (numRepeats % 2) ? times[numRepeats / 2]
+                                     : 0.5 * (times[numRepeats/2 - 1] + times[numRepeats/2]);
+    printf("%s %s %s %.6f %.6f %.4g\n", stage, name, variant, median, times[0],
+           (median > 0.0) ? items / median : 0.0);
+    fflush(stdout);
+}
+
+
+static void
+benchmark(const char* samplesFilename, int numSamples, int numSequences, int numRepeats)
+{
+    const size_t numPoints = (size_t) numSamples * numSequences;
+    double* xs = (double *) malloc(numPoints * sizeof(double));
+    double* ys = (double *) malloc(numPoints * sizeof(double));
+    double* times = (double *) malloc(numRepeats * sizeof(double));
+    double results[EVALBATCH];
+    int r, f, s, t;
+
+    printf("# stage name variant median_s min_s items_per_s\n");
+
+    // Read and parse the sample file
+    double* coords = allocSampleTable(numSequences, 2, numSamples);
+    samplePoints = pointRows(coords);
+    for (r = 0; r < numRepeats; r++) {
+        double t0 = wallTime();
+        readSamples<2>(samplesFilename, 2, numSamples, numSequences, coords);
+        times[r] = wallTime() - t0;
+    }
+    printBenchLine("parse", samplesFilename, "file", times, numRepeats, numPoints);
+
+    // Gather the points of every sample count into contiguous x and y arrays
+    initSampleSet(&sampleSet, coords, 2, numSamples, SOURCEFILE, SHIFTNONE, 1, numSequences, 1);
+    for (r = 0; r < numRepeats; r++) {
+        double t0 = wallTime();
+        for (s = 0; s < numSamples; s++) {
+            double* const x[2] = { xs + (size_t) s * numSequences,
+                                   ys + (size_t) s * numSequences };
+            gatherTrials<2>(&sampleSet, s, 0, numSequences, x);
+        }
+        times[r] = wallTime() - t0;
+    }
+    printBenchLine("layout", "gather", "soa", times, numRepeats, numPoints);
+
+    // Read the points from the sample table in sample-major order, as the main loop does
+    for (r = 0; r < numRepeats; r++) {
+        double sum = 0.0;
+        double t0 = wallTime();
+        for (s = 0; s < numSamples; s++)
+            for (t = 0; t < numSequences; t++)
+                sum += samplePoints[t][s].x + samplePoints[t][s].y;
+        times[r] = wallTime() - t0;
+        benchSink += sum;
+    }
+    printBenchLine("layout", "strided", "aos", times, numRepeats, numPoints);
+
+    // Evaluate each function at all points, one at a time and in batches
+    for (f = 0; f < NUMFUNCTIONS; f++) {
+        double sum = 0.0;
+        for (r = 0; r < numRepeats; r++) {
+            double t0 = wallTime();
+            for (size_t k = 0; k < numPoints; k++)
+                sum += evaluateFunctionAt(f, xs[k], ys[k]);
+            times[r] = wallTime() - t0;
+        }
+        printBenchLine("eval", functionTable[f].name, "scalar", times, numRepeats, numPoints);
+
+        for (r = 0; r < numRepeats; r++) {
+            double t0 = wallTime();
+            for (size_t k0 = 0; k0 < numPoints; k0 += EVALBATCH) {
+                int n = (int) MIN((size_t) EVALBATCH, numPoints - k0);
+                evaluateFunctionBatch(f, xs + k0, ys + k0, results, n);
+                for (int k = 0; k < n; k++)
+                    sum += results[k];
+            }
+            times[r] = wallTime() - t0;
+        }
+        printBenchLine("eval", functionTable[f].name, "batch", times, numRepeats, numPoints);
+        benchSink += sum;
+    }
+
+    // Format and write an error table
+    FILE* nullFile = fopen("/dev/null", "w");
+    if (nullFile) {
+        int numLines = numSamples / OUTPUTINTERVAL;
+        for (r = 0; r < numRepeats; r++) {
+            double t0 = wallTime();
+            for (s = 1; s <= numLines; s++)
+                fprintf(nullFile, "%i %f\n", s * OUTPUTINTERVAL, 1.0 / sqrt((double) s));
+            fflush(nullFile);
+            times[r] = wallTime() - t0;
+        }
+        printBenchLine("output", "errortable", "stdio", times, numRepeats, numLines);
+        fclose(nullFile);
+    }
+
+    free(xs);
+    free(ys);
+    free(times);
+}
+
+
+//
+// Check of the branchless functions.
+//
+// Evaluates every function with the branchless versions and with the original functions
+// (--branchy) at the points of the sample file, a 1025x1025 grid including the edges of the
+// unit square, and points on and next to the edges of the pieces (the disk and ramp radii, the
+// ramp ends and the triangle diagonals), and counts the results that are not bit-identical.
+//
+
+#define VERIFYGRID 1025
+#define VERIFYANGLES 4096
+
+// Add point (x,y) and its floating-point neighbors in x and y that are in the unit square
+// to the arrays
+static void
+addVerifyPoints(double x, double y, double* xs, double* ys, size_t* n)
+{
+    const double xn[3] = { nextafter(x, -1.0), x, nextafter(x, 2.0) };
+    const double yn[3] = { nextafter(y, -1.0), y, nextafter(y, 2.0) };
+    for (int i = 0; i < 3; i++) {
+        for (int j = 0; j < 3; j++) {
+            if (xn[i] < 0.0 || xn[i] > 1.0 || yn[j] < 0.0 || yn[j] > 1.0)
+                continue;
+            xs[*n] = xn[i];
+            ys[*n] = yn[j];
+            (*n)++;
+        }
+    }
+}
+
+
+// Returns the number of mismatches
+static int
+verifyBranchless(int numSamples, int numSequences)
+{
+    const double radii[6] = { sqrt(2.0 / M_PI), 0.7, 0.9, sqrt(1.0 / (2.0 * M_PI)), 0.35, 0.45 };
+    const double centers[6] = { 0.0, 0.0, 0.0, 0.5, 0.5, 0.5 };
+    const double edges[4] = { 0.2, 0.4, 1.0/M_PI, 0.5 };
+    size_t maxPoints = (size_t) numSamples * numSequences + VERIFYGRID * VERIFYGRID +
+                       9 * (6 * VERIFYANGLES + 3 * 4 * VERIFYGRID);
+    double* xs = (double *) malloc(maxPoints * sizeof(double));
+    double* ys = (double *) malloc(maxPoints * sizeof(double));
+    double* fast = (double *) malloc(maxPoints * sizeof(double));
+    double* branchy = (double *) malloc(maxPoints * sizeof(double));
+    size_t n = 0, k;
+    int i, j, f, totalMismatches = 0;
+
+    for (i = 0; i < numSequences; i++) {
+        for (j = 0; j < numSamples; j++) {
+            xs[n] = samplePoints[i][j].x;
+            ys[n] = samplePoints[i][j].y;
+            n++;
+        }
+    }
+    for (i = 0; i < VERIFYGRID; i++) {
+        for (j = 0; j < VERIFYGRID; j++) {
+            xs[n] = i / (VERIFYGRID - 1.0);
+            ys[n] = j / (VERIFYGRID - 1.0);
+            n++;
+        }
+    }
+    // Circles of the disks and ramps
+    for (i = 0; i < 6; i++) {
+        for (j = 0; j < VERIFYANGLES; j++) {
+            double phi = 2.0 * M_PI * j / VERIFYANGLES;
+            addVerifyPoints(centers[i] + radii[i] * cos(phi), centers[i] + radii[i] * sin(phi),
+                            xs, ys, &n);
+        }
+    }
+    // Lines x = edge, y = x +- 0.1 (triangle ramp ends) and x + y = 1 (triangle)
+    for (j = 0; j < VERIFYGRID; j++) {
+        double v = j / (VERIFYGRID - 1.0);
+        for (i = 0; i < 4; i++)
+            addVerifyPoints(edges[i], v, xs, ys, &n);
+        addVerifyPoints(v, v + 0.1, xs, ys, &n);
+        addVerifyPoints(v, v - 0.1, xs, ys, &n);
+        addVerifyPoints(v, 1.0 - v, xs, ys, &n);
+    }
+    assert(n <= maxPoints);
+
+    for (f = 0; f < NUMFUNCTIONS; f++) {
+        int mismatches = 0;
+        for (k = 0; k < n; k += EVALBATCH) {
+            int m = (int) MIN((size_t) EVALBATCH, n - k);
+            branchyIntegrands = false;
+            evaluateFunctionBatch(f, xs + k, ys + k, fast + k, m);
+            branchyIntegrands = true;
+            evaluateFunctionBatch(f, xs + k, ys + k, branchy + k, m);
+        }
+        for (k = 0; k < n; k++)
+            if (memcmp(&fast[k], &branchy[k], sizeof(double)) != 0)
+                mismatches++;
+        printf("verify %s %zu %i\n", functionTable[f].name, n, mismatches);
+        totalMismatches += mismatches;
+    }
+    branchyIntegrands = false;
+
+    // Largest difference between the polynomial exp and sin and libm
+    const int tiers[2] = { MATHACCURATE, MATHFAST };
+    const char* tierNames[2] = { "accurate", "fast" };
+    const double tolerances[2] = { 1e-15, 1e-9 };
+    for (i = 0; i < 2; i++) {
+        for (f = 0; f < NUMFUNCTIONS; f++) {
+            double maxError = 0.0, maxAbsError = 0.0;
+            for (k = 0; k < n; k += EVALBATCH) {
+                int m = (int) MIN((size_t) EVALBATCH, n - k);
+                mathTier = MATHLIBM;
+                evaluateFunctionBatch(f, xs + k, ys + k, fast + k, m);
+                mathTier = tiers[i];
+                evaluateFunctionBatch(f, xs + k, ys + k, branchy + k, m);
+            }
+            // libm sin(pi/r) has the rounding error of pi/r, so for sininvr the error is
+            // relative to 1 + pi/r; the absolute error is printed as well
+            for (k = 0; k < n; k++) {
+                double error = fabs(fast[k] - branchy[k]);
+                maxAbsError = MAX(error, maxAbsError);
+                if (f == 11)
+                    error /= 1.0 + M_PI / MAX(sqrt(xs[k]*xs[k] + ys[k]*ys[k]), 1e-300);
+                maxError = MAX(error, maxError);
+            }
+            if (maxError > 0.0 && f == 11)
+                printf("verify fastmath %s %s maxerror %g relative to 1+pi/r (absolute %g)\n",
+                       tierNames[i], functionTable[f].name, maxError, maxAbsError);
+            else if (maxError > 0.0)
+                printf("verify fastmath %s %s maxerror %g\n", tierNames[i],
+                       functionTable[f].name, maxError);
+            if (maxError > tolerances[i])
+                totalMismatches++;
+        }
+    }
+    mathTier = MATHLIBM;
+
+    printf("verify %s\n", totalMismatches ? "FAILED" : "OK");
+
+    free(xs);
+    free(ys);
+    free(fast);
+    free(branchy);
+    return totalMismatches;
+}
+
+
+//
+// Hardware performance counters.
+//
+// With --perf the parse phase (reading the sample file) and the evaluation phase (everything
+// after it) are each counted with Linux perf_event_open counters for cycles, instructions,
+// last-level cache misses and branch misses, in user space only.  The counters are opened
+// with inherit so the worker threads are included, and the counts are scaled by the time
+// each counter was actually scheduled if the kernel had to multiplex them.  The IPC and
+// the misses per sample point are printed on stderr.
+//
+
+#define NUMPERFCOUNTERS 4
+
+const char* perfCounterNames[NUMPERFCOUNTERS] =
+    { "cycles", "instructions", "LLC-misses", "branch-misses" };
+
+struct PerfCounters {
+    int fd[NUMPERFCOUNTERS];   // -1 if the counter could not be opened
+};
+
+bool perfWarned[NUMPERFCOUNTERS];   // a counter that could not be opened is reported once
+
+
+// Open and start the counters
+static void
+perfStart(PerfCounters* counters)
+{
+#ifdef __linux__
+    const unsigned long long configs[NUMPERFCOUNTERS] =
+        { PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+          PERF_COUNT_HW_BRANCH_MISSES };
+    for (int c = 0; c < NUMPERFCOUNTERS; c++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = configs[c];
+        attr.disabled = 1;
+        attr.inherit = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        counters->fd[c] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (counters->fd[c] < 0 && !perfWarned[c]) {
+            fprintf(stderr, "perf: cannot open %s counter: %s\n", perfCounterNames[c],
+                    strerror(errno));
+            perfWarned[c] = true;
+        }
+    }
+    for (int c = 0; c < NUMPERFCOUNTERS; c++) {
+        if (counters->fd[c] >= 0) {
+            ioctl(counters->fd[c], PERF_EVENT_IOC_RESET, 0);
+            ioctl(counters->fd[c], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    for (int c = 0; c < NUMPERFCOUNTERS; c++)
+        counters->fd[c] = -1;
+    fprintf(stderr, "perf: hardware counters are only supported on Linux\n");
+#endif
+}
+
+
+// Stop and close the counters, and print the counts for the phase on stderr
+static void
+perfStop(PerfCounters* counters, const char* phase, double numPoints)
+{
+    double counts[NUMPERFCOUNTERS];
+    bool valid[NUMPERFCOUNTERS];
+
+    for (int c = 0; c < NUMPERFCOUNTERS; c++) {
+        valid[c] = false;
+        counts[c] = 0.0;
+#ifdef __linux__
+        unsigned long long values[3];   // value, time enabled, time running
+        if (counters->fd[c] < 0)
+            continue;
+        ioctl(counters->fd[c], PERF_EVENT_IOC_DISABLE, 0);
+        if (read(counters->fd[c], values, sizeof(values)) == sizeof(values) && values[2] > 0) {
+            counts[c] = (double) values[0] * ((double) values[1] / values[2]);
+            valid[c] = true;
+        }
+        close(counters->fd[c]);
+        counters->fd[c] = -1;
+#endif
+    }
+
+    fprintf(stderr, "perf %s:", phase);
+    for (int c = 0; c < NUMPERFCOUNTERS; c++) {
+        if (!valid[c])
+            fprintf(stderr, " %s n/a", perfCounterNames[c]);
+        else if (c >= 2 && numPoints > 0.0)
+            fprintf(stderr, " %s %.0f (%.4f per sample)", perfCounterNames[c], counts[c],
+                    counts[c] / numPoints);
+        else
+            fprintf(stderr, " %s %.0f", perfCounterNames[c], counts[c]);
+    }
+    if (valid[0] && valid[1] && counts[0] > 0.0)
+        fprintf(stderr, " IPC %.2f", counts[1] / counts[0]);
+    fprintf(stderr, "\n");
+}
+
+
+static void
+usage()
+{
+    printf("Usage: funcsamp2D [options] functionName samplesFilename [numSamples numSequences]\n");
+    printf("       funcsamp2D discrepancy samplesFilename [numSamples numSequences]\n");
+    printf("       funcsamp2D spectrum samplesFilename [numSamples numSequences]\n");
+    printf("       funcsamp2D [--repeats n] bench samplesFilename [numSamples numSequences]\n");
+    printf("       funcsamp2D verify samplesFilename [numSamples numSequences]\n");
+    printf("       funcsamp2D merge partialFile ...\n");
+    printf("Options:\n");
+    printf("  --instances n   number of random integrands for randomdisks, randomhalfplanes\n");
+    printf("                  and randomgaussians (default 1000)\n");
+    printf("  --seed n        seed for the random integrands (default 1)\n");
+    printf("  --image file    integrate a PFM image instead of a named function; the\n");
+    printf("                  functionName argument is then left out\n");
+    printf("  --filter f      image filter: nearest or bilinear (default bilinear)\n");
+    printf("  --expr e        integrate an expression in x and y, for example\n");
+    printf("                  \"exp(-x*x-4*y*y)\", instead of a named function\n");
+    printf("  --subranges k   print errors of samples [offset, offset+N) for offsets 0, k,\n");
+    printf("                  2k, ... instead of only offset 0\n");
+    printf("  --copies k      use k randomly shifted copies of each sequence as trials\n");
+    printf("  --shift s       randomization for --copies: cp (toroidal shift, default),\n");
+    printf("                  xor (digital shift) or owen (base-2 Owen scrambling)\n");
+    printf("  --pair file     zip the points with the points of a second sample file (or\n");
+    printf("                  owen-sobol or owen-halton) into 4D points; the function is\n");
+    printf("                  then f*g, cross:f*g, ball4D or simplex4D\n");
+    printf("  --adaptive tol  use only as many of the sequences as needed for a relative\n");
+    printf("                  standard error of at most tol at every sample count\n");
+    printf("  --fastmath t    evaluate exp and sin with polynomials: accurate (error\n");
+    printf("                  < 1e-15) or fast (error < 1e-9); for sininvr the\n");
+    printf("                  errors are relative to 1 + pi/r\n");
+    printf("  --branchy       evaluate triangleramp, stepx and rampx with the\n");
+    printf("                  original if/else versions instead of the branchless ones\n");
+    printf("  --cache         store the function values in a cache file next to the sample\n");
+    printf("                  file, or use them from there if it exists\n");
+    printf("  --checkpoint f  write the state of the run to file f every minute\n");
+    printf("  --checkpoint-every s  checkpoint interval in seconds (default 60)\n");
+    printf("  --resume        continue from the --checkpoint file if it exists\n");
+    printf("  --sequence-range a:b  use only sequences a .. b-1\n");
+    printf("  --partial f     write the error sums of the sequences to the partial result\n");
+    printf("                  file f, for \"funcsamp2D merge\"\n");
+    printf("  --numa          pin the worker threads to CPUs by NUMA node and place each\n");
+    printf("                  thread's sequences in memory on its node\n");
+    printf("  --no-hugepages  allocate the large arrays without 2 MB huge pages\n");
+    printf("  --perf          print hardware performance counts for the parse and\n");
+    printf("                  evaluation phases on stderr (Linux)\n");
+    printf("  --repeats n     number of repeats of each bench stage (default 5)\n");
+    printf("  --fit lo:hi     print the least-squares log-log slope of the errors for\n");
+    printf("                  sample counts lo..hi; several ranges can be separated by commas\n");
+    printf("  --dim d         the sample file has d coordinates per sample (default 2); for\n");
+    printf("                  d other than 2 the function must be ballND, gaussianND,\n");
+    printf("                  simplexND, sinND or quadraticND\n");
+    printf("  --jit           compile the --expr expression to native code\n");
+    printf("  --plugin file   integrate the function in a plugin shared object (see\n");
+    printf("                  funcsamp2D_plugin.h) instead of a named function\n");
+}
+
+
+int
+main(int argc, char *argv[]) {
+    double* sumresults;
+    double reference = 0.0;
+    int functionNumber = -1;
+    int numSamples = 1024, numSequences = 100;
+    int s, t, i;
+    int numInstances = 1000, familyType = -1;
+    long seed = 1;
+    bool discrepancyMode = false, spectrumMode = false, benchMode = false, verifyMode = false;
+    int numRepeats = BENCHREPEATS;
+    bool perfMode = false, cacheMode = false, resume = false, mergeMode = false;
+    char* partialFilename = NULL;
+    char** mergeFilenames = (char **) malloc(argc * sizeof(char *));
+    int numMergeFiles = 0, sequenceBegin = 0, sequenceEnd = -1;
+    char* checkpointFilename = NULL;
+    double checkpointInterval = CHECKPOINTINTERVAL;
+    PerfCounters perfCounters;
+    char *functionName = NULL, *samplesFilename = NULL, *imageFilename = NULL, *exprText = NULL;
+    char *pluginFilename = NULL, *pairFilename = NULL;
+    Function4D function4D = { F4PRODUCT, 0, 0, 0.0 };
+    int dim = 2;
+    double tolerance = 0.0;
+    bool jit = false;
+    int offsetStep = 0, numCopies = 1, shiftType = SHIFTCP;
+    bool bilinear = true;
+    char *args[4];
+    int numArgs = 0;
+
+    // Separate options from the other arguments
+    for (i = 1; i < argc; i++) {
+        if (mergeMode && strncmp(argv[i], "--", 2) != 0) {
+            mergeFilenames[numMergeFiles++] = argv[i];
+        } else if (numArgs == 0 && strcmp(argv[i], "merge") == 0) {
+            mergeMode = true;
+        } else if (strncmp(argv[i], "--", 2) != 0) {
+            if (numArgs == 4) {
+                usage();
+                return 1;
+            }
+            args[numArgs++] = argv[i];
+        } else if (strcmp(argv[i], "--instances") == 0 && i+1 < argc) {
+            numInstances = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--seed") == 0 && i+1 < argc) {
+            seed = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--image") == 0 && i+1 < argc) {
+            imageFilename = argv[++i];
+        } else if (strcmp(argv[i], "--plugin") == 0 && i+1 < argc) {
+            pluginFilename = argv[++i];
+        } else if (strcmp(argv[i], "--subranges") == 0 && i+1 < argc) {
+            offsetStep = atoi(argv[++i]);
+            if (offsetStep <= 0) {
+                printf("--subranges needs a positive offset step\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--copies") == 0 && i+1 < argc) {
+            numCopies = atoi(argv[++i]);
+            if (numCopies <= 0) {
+                printf("--copies needs a positive number of copies\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--shift") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "cp") == 0) {
+                shiftType = SHIFTCP;
+            } else if (strcmp(argv[i], "xor") == 0) {
+                shiftType = SHIFTXOR;
+            } else if (strcmp(argv[i], "owen") == 0) {
+                shiftType = SHIFTOWEN;
+            } else {
+                printf("Unknown shift: '%s'\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--pair") == 0 && i+1 < argc) {
+            pairFilename = argv[++i];
+        } else if (strcmp(argv[i], "--adaptive") == 0 && i+1 < argc) {
+            tolerance = atof(argv[++i]);
+            if (tolerance <= 0.0) {
+                printf("--adaptive needs a positive tolerance\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fastmath") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "accurate") == 0)
+                mathTier = MATHACCURATE;
+            else if (strcmp(argv[i], "fast") == 0)
+                mathTier = MATHFAST;
+            else {
+                printf("--fastmath must be accurate or fast\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--branchy") == 0) {
+            branchyIntegrands = true;
+        } else if (strcmp(argv[i], "--perf") == 0) {
+            perfMode = true;
+            arenaReport = true;
+        } else if (strcmp(argv[i], "--numa") == 0) {
+            numaPlacement = true;
+        } else if (strcmp(argv[i], "--no-hugepages") == 0) {
+            hugePages = false;
+        } else if (strcmp(argv[i], "--cache") == 0) {
+            cacheMode = true;
+        } else if (strcmp(argv[i], "--checkpoint") == 0 && i+1 < argc) {
+            checkpointFilename = argv[++i];
+        } else if (strcmp(argv[i], "--checkpoint-every") == 0 && i+1 < argc) {
+            checkpointInterval = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--resume") == 0) {
+            resume = true;
+        } else if (strcmp(argv[i], "--sequence-range") == 0 && i+1 < argc) {
+            if (sscanf(argv[++i], "%i:%i", &sequenceBegin, &sequenceEnd) != 2 ||
+                sequenceBegin < 0 || sequenceEnd <= sequenceBegin) {
+                printf("--sequence-range needs a:b with 0 <= a < b\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--partial") == 0 && i+1 < argc) {
+            partialFilename = argv[++i];
+        } else if (strcmp(argv[i], "--repeats") == 0 && i+1 < argc) {
+            numRepeats = atoi(argv[++i]);
+            if (numRepeats <= 0) {
+                printf("--repeats needs a positive number\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--fit") == 0 && i+1 < argc) {
+            if (!parseFitRanges(argv[++i])) {
+                printf("--fit needs ranges lo:hi with 0 < lo < hi (at most %i ranges)\n", MAXFITS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--dim") == 0 && i+1 < argc) {
+            dim = atoi(argv[++i]);
+            if (dim < 1 || dim > NDMAXDIM) {
+                printf("--dim must be between 1 and %i\n", NDMAXDIM);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--jit") == 0) {
+            jit = true;
+        } else if (strcmp(argv[i], "--expr") == 0 && i+1 < argc) {
+            exprText = argv[++i];
+        } else if (strcmp(argv[i], "--filter") == 0 && i+1 < argc) {
+            i++;
+            if (strcmp(argv[i], "nearest") == 0) {
+                bilinear = false;
+            } else if (strcmp(argv[i], "bilinear") == 0) {
+                bilinear = true;
+            } else {
+                printf("Unknown filter: '%s'\n", argv[i]);
+                return 1;
+            }
+        } else {
+            printf("Unknown option: '%s'\n", argv[i]);
+            usage();
+            return 1;
+        }
+    }
+
+    // An integrand given by an option takes the place of the function name
+    if (imageFilename || exprText || pluginFilename) {
+        if (numArgs == 4) {
+            usage();
+            return 1;
+        }
+        for (i = numArgs; i > 0; i--)
+            args[i] = args[i-1];
+        args[0] = NULL;
+        numArgs++;
+    }
+
+    if (mergeMode) {
+        mergePartials(numMergeFiles, mergeFilenames);
+        printFits();
+        return 0;
+    }
+
+    if (numArgs < 2) {
+        usage();
+        return 1;
+    }
+
+    numThreads = MAX((int)std::thread::hardware_concurrency(), 1);
+    if (numaPlacement) {
+        numaPlacement = false;   // set again if the threads can be pinned
+        initNumaPlacement();
+    }
+
+    // Find function name in table of known functions
+    functionName = args[0];
+    if (imageFilename) {
+        readImage(imageFilename, &integrandImage, bilinear);
+        functionNumber = IMAGEFUNCTION;
+        reference = integrandImage.refValue;
+    } else if (exprText) {
+        compileExpression(exprText, &integrandExpression, !jit);
+        functionNumber = EXPRFUNCTION;
+        if (jit && jitCompileExpression(&integrandExpression, &integrandPlugin)) {
+            functionNumber = PLUGINFUNCTION;
+            integrandExpression.refValue = integrandPlugin.refValue;
+        } else if (jit) {
+            fprintf(stderr, "JIT compilation of '%s' failed; using the interpreter\n", exprText);
+            compileExpression(exprText, &integrandExpression, true);
+        }
+        reference = integrandExpression.refValue;
+    } else if (pluginFilename) {
+        loadPlugin(pluginFilename, &integrandPlugin);
+        functionNumber = PLUGINFUNCTION;
+        reference = integrandPlugin.refValue;
+    } else if (pairFilename) {
+        if (!parseFunction4D(functionName, &function4D)) {
+            printf("Unknown 4D function: '%s'\n", functionName);
+            exit(1);
+        }
+    } else if (findFunctionND(functionName) >= 0) {
+        functionNumber = NDFUNCTION + findFunctionND(functionName);
+        reference = referenceND(functionNumber - NDFUNCTION, dim);
+    } else if (strcmp(functionName, "discrepancy") == 0) {
+        discrepancyMode = true;
+    } else if (strcmp(functionName, "spectrum") == 0) {
+        spectrumMode = true;
+    } else if (strcmp(functionName, "bench") == 0) {
+        benchMode = true;
+    } else if (strcmp(functionName, "verify") == 0) {
+        verifyMode = true;
+    } else {
+        bool match = false;
+        for (i = 0; i < NUMFUNCTIONS; i++) {
+            match = (strcmp(functionName, functionTable[i].name) == 0);
+            if (match) break;
+        }
+        for (int k = 0; !match && k < NUMFAMILIES; k++) {
+            if (strcmp(functionName, familyNames[k]) == 0)
+                familyType = k;
+        }
+
+        if (i == NUMFUNCTIONS && familyType < 0) {
+            printf("Unknown function: '%s'\n", functionName);
+            exit(1);
+        }
+
+        functionNumber = i;
+        if (familyType < 0)
+            reference = functionTable[i].refValue;
+    }
+
+    samplesFilename = args[1];
+
+    if (numArgs > 2)
+        numSamples = atoi(args[2]);   // number of sample points
+
+    if (numArgs > 3)
+        numSequences = atoi(args[3]);   // number of sequences (trials)
+
+    if (benchMode) {
+        benchmark(samplesFilename, numSamples, numSequences, numRepeats);
+        return 0;
+    }
+
+    // Sample points are read from a file or generated as they are needed
+    int source = SOURCEFILE;
+    if (strcmp(samplesFilename, "owen-sobol") == 0)
+        source = SOURCEOWENSOBOL;
+    else if (strcmp(samplesFilename, "owen-halton") == 0)
+        source = SOURCEOWENHALTON;
+
+    // In other dimensions than 2 there are only the N-dimensional functions on sample files
+    if (dim != 2 && functionNumber < NDFUNCTION) {
+        printf("With --dim %i the function must be ballND, gaussianND, simplexND, sinND or "
+               "quadraticND\n", dim);
+        exit(1);
+    }
+    if (dim != 2 && source != SOURCEFILE) {
+        printf("owen-sobol and owen-halton are 2D; --dim %i needs a sample file\n", dim);
+        exit(1);
+    }
+
+    // Each sequence gives numCopies trials; trial numbers are ints
+    const long long numTrials64 = (long long) numSequences * numCopies;
+    if (numTrials64 > INT_MAX) {
+        printf("%i sequences with --copies %i give %lli trials, more than the %i supported\n",
+               numSequences, numCopies, numTrials64, INT_MAX);
+        exit(1);
+    }
+    int numTrials = (int) numTrials64;
+
+    // Trials of the --sequence-range
+    if (sequenceEnd < 0)
+        sequenceEnd = numSequences;
+    if (sequenceEnd > numSequences) {
+        printf("--sequence-range %i:%i is outside the %i sequences\n", sequenceBegin, sequenceEnd,
+               numSequences);
+        exit(1);
+    }
+    const bool fullRange = (sequenceBegin == 0 && sequenceEnd == numSequences);
+    const int trialBegin = sequenceBegin * numCopies, trialEnd = sequenceEnd * numCopies;
+    if ((!fullRange || partialFilename) &&
+        (discrepancyMode || spectrumMode || verifyMode || benchMode || pairFilename ||
+         offsetStep > 0 || tolerance > 0.0 || familyType >= 0)) {
+        printf("--sequence-range and --partial only apply to the main error table\n");
+        exit(1);
+    }
+    initSampleSet(&sampleSet, NULL, dim, numSamples, source,
+                  (numCopies > 1) ? shiftType : SHIFTNONE, numCopies, numTrials, seed);
+
+    const double numPoints = (double) numSamples * numTrials;
+
+    if (resume && !checkpointFilename) {
+        printf("--resume needs --checkpoint file\n");
+        exit(1);
+    }
+    if (checkpointFilename &&
+        (discrepancyMode || spectrumMode || verifyMode || benchMode || pairFilename ||
+         offsetStep > 0 || tolerance > 0.0 || familyType >= 0)) {
+        printf("--checkpoint and --resume only apply to the main error table\n");
+        exit(1);
+    }
+    if (numaPlacement && (verifyMode || benchMode || pairFilename || tolerance > 0.0)) {
+        printf("--numa does not apply to --pair, --adaptive, verify and bench\n");
+        exit(1);
+    }
+
+    // Key of the sample file (or generator), function and parameters, for cached function
+    // values and checkpoints
+    unsigned long long runKey = 0;
+    if (cacheMode || checkpointFilename || partialFilename) {
+        int params[8] = { numSamples, numTrials, numCopies, (numCopies > 1) ? shiftType : -1,
+                          (int) seed, mathTier, jit, dim };
+        runKey = (source == SOURCEFILE) ? hashFile(0xcbf29ce484222325ULL, samplesFilename)
+                                        : hashString(0xcbf29ce484222325ULL, samplesFilename);
+        if (imageFilename) {
+            runKey = hashFile(hashString(runKey, "image"), imageFilename);
+            runKey = hashBytes(runKey, &bilinear, sizeof(bilinear));
+        } else if (exprText) {
+            runKey = hashString(hashString(runKey, "expr"), exprText);
+        } else if (pluginFilename) {
+            runKey = hashFile(hashString(runKey, "plugin"), pluginFilename);
+        } else {
+            runKey = hashString(runKey, functionName);
+        }
+        runKey = hashBytes(runKey, params, sizeof(params));
+    }
+
+    // Cached function values for the error tables of a sample file
+    if (cacheMode) {
+        if (source != SOURCEFILE || discrepancyMode || spectrumMode || verifyMode ||
+            pairFilename || familyType >= 0)
+            fprintf(stderr, "--cache only applies to the error tables of a function on a sample file\n");
+        else
+            initValueCache(&valueCache, samplesFilename, runKey, numSamples, numTrials);
+    }
+
+    // Read tables (not needed if all function values are cached).  With --numa the rows are
+    // first touched by the threads that evaluate them: in blocks of sequences, or for the main
+    // error table by runs of trial tiles.
+    const bool mainTable = !discrepancyMode && !spectrumMode && offsetStep == 0 &&
+                           familyType < 0;
+    const MainLoopSplit split = mainLoopSplit(trialEnd - trialBegin, numThreads);
+    const bool numaRows = numaPlacement && numSamples <= MAXSAMPLES && numSequences <= MAXTABLES;
+    if (perfMode) perfStart(&perfCounters);
+    if (valueCache.loaded) {
+        // nothing to read
+    } else if (source == SOURCEFILE) {
+        double* coords = allocSampleTable(numSequences, dim, numSamples);
+        sampleSet.coords = coords;
+        if (dim == 2)
+            samplePoints = pointRows(coords);
+        if (numaRows && mainTable)
+            firstTouchTrialRows(coords, dim, numSamples, sequenceBegin, sequenceEnd, numCopies,
+                                &split);
+        else if (numaRows)
+            firstTouchSamples(coords, dim, numSamples, numSequences);
+        withDimension(dim, [&](auto D) {
+            readSamples<decltype(D)::value>(samplesFilename, dim, numSamples, numSequences,
+                                            coords);
+        });
+    } else if (discrepancyMode || spectrumMode) {
+        // These modes read samplePoints: store the generated sequences there
+        if (numSamples > MAXSAMPLES || numSequences > MAXTABLES) {
+            printf("Too many samples or sequences (max %i samples, %i sequences)\n",
+                   MAXSAMPLES, MAXTABLES);
+            exit(1);
+        }
+        double* coords = allocSampleTable(numSequences, 2, numSamples);
+        samplePoints = pointRows(coords);
+        if (numaRows)
+            firstTouchSamples(coords, 2, numSamples, numSequences);
+        for (t = 0; t < numSequences; t++)
+            for (s = 0; s < numSamples; s++)
+                generatedSample(&sampleSet, t, s, &samplePoints[t][s].x, &samplePoints[t][s].y);
+    }
+
+    if (perfMode) {
+        perfStop(&perfCounters, "parse", (double) numSamples * numSequences);
+        perfStart(&perfCounters);
+    }
+
+    if (verifyMode) {
+        if (source != SOURCEFILE) {
+            printf("verify needs a sample file\n");
+            exit(1);
+        }
+        return verifyBranchless(numSamples, numSequences) ? 1 : 0;
+    }
+    if (discrepancyMode) {
+        discrepancyTable(numSamples, numSequences);
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+    if (spectrumMode) {
+        spectrumTables(samplesFilename, numSamples, numSequences);
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+
+    if (pairFilename) {
+        // The second sample set is randomized like the first, with its own seeds
+        int pairSource = SOURCEFILE;
+        double* pairCoords = NULL;
+        if (strcmp(pairFilename, "owen-sobol") == 0)
+            pairSource = SOURCEOWENSOBOL;
+        else if (strcmp(pairFilename, "owen-halton") == 0)
+            pairSource = SOURCEOWENHALTON;
+        else {
+            pairCoords = allocSampleTable(numSequences, 2, numSamples);
+            readSamples<2>(pairFilename, 2, numSamples, numSequences, pairCoords);
+        }
+        SampleSet pairSet;
+        initSampleSet(&pairSet, pairCoords, 2, numSamples, pairSource, sampleSet.type, numCopies,
+                      numTrials, hashCombine((unsigned) seed, 0x70a1u));
+        errorTable4D(&function4D, &sampleSet, &pairSet, numSamples, numTrials);
+        printFits();
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+    if (offsetStep > 0) {
+        if (familyType >= 0) {
+            printf("--subranges cannot be used with random integrand families\n");
+            exit(1);
+        }
+        withDimension(dim, [&](auto D) {
+            subrangeErrorTable<decltype(D)::value>(functionNumber, reference, numSamples,
+                                                   numTrials, offsetStep);
+        });
+        writeValueCache(&valueCache);
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+    if (tolerance > 0.0) {
+        if (familyType >= 0) {
+            printf("--adaptive cannot be used with random integrand families\n");
+            exit(1);
+        }
+        withDimension(dim, [&](auto D) {
+            adaptiveErrorTable<decltype(D)::value>(functionNumber, reference, numSamples,
+                                                   numTrials, tolerance);
+        });
+        printFits();
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+    if (familyType >= 0) {
+        IntegrandFamily family;
+        initIntegrandFamily(&family, familyType, numInstances, seed);
+        familyErrorTable(&family, numSamples, numTrials);
+        freeIntegrandFamily(&family);
+        printFits();
+        if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
+        return 0;
+    }
+
+    // Allocate and init
+    sumresults = (double *) arenaAlloc(numTrials * sizeof(double));
+    for (t = 0; t < numTrials; t++)
+        sumresults[t] = 0.0;   // memset?
+
+    // Continue from a checkpoint.  A sharded run prints the exact sums, which merge gives too.
+    ErrorSums errorSums;
+    initErrorSums(&errorSums, numSamples, numTrials, trialBegin, trialEnd);
+    const bool exactOutput = !fullRange || partialFilename;
+    bool resumed = false;
+    if (resume && readCheckpoint(checkpointFilename, runKey, &errorSums, sumresults)) {
+        resumed = true;
+        fprintf(stderr, "Resuming from sample %i\n", errorSums.numCounts * OUTPUTINTERVAL);
+        for (i = 0; i < errorSums.numCounts; i++) {
+            double sum = exactOutput ? fromExactSum(errorSums.sums[i]) + errorSums.outside[i]
+                                     : errorSums.plain[i];
+            printError((i+1) * OUTPUTINTERVAL, sum / (trialEnd - trialBegin));
+        }
+        fflush(stdout);
+    }
+
+    // The error table, with the dimension of the sample set compiled in
+    MainTable table = { functionNumber, reference, numSamples, trialBegin, trialEnd, exactOutput,
+                        split, &errorSums, sumresults, checkpointFilename, checkpointInterval,
+                        runKey };
+    withDimension(dim, [&](auto D) { mainErrorTable<decltype(D)::value>(&table); });
+    if (checkpointFilename)
+        unlink(checkpointFilename);   // the run is complete
+    if (partialFilename)
+        writePartial(partialFilename, runKey, &errorSums);
+    printFits();
+    if (fullRange && !resumed)   // a resumed run has no values for the samples before the checkpoint
+        writeValueCache(&valueCache);
+
+    if (perfMode) perfStop(&perfCounters, "evaluate", numPoints);
 
     return 0; // ok
 }
@@ -0,0 +1,61 @@
+//
+// funcsamp2D_plugin.h
+// Interface for integrand plugins that funcsamp2D loads at run time with --plugin.
+//
+// A plugin is a shared object that exports the functions declared below with C linkage.
+// funcsamp2D calls the evaluate function with batches of points, so the cost of the call
+// through a function pointer is paid once per batch and not once per point.
+//
+// Example plugin (myplugin.cpp):
+//
+//   #include <math.h>
+//   #include "funcsamp2D_plugin.h"
+//
+//   int funcsamp2D_pluginVersion() { return FUNCSAMP2D_PLUGIN_VERSION; }
+//   const char* funcsamp2D_name() { return "cosinelobe"; }
+//   double funcsamp2D_reference() { return NAN; }   // not known: integrate numerically
+//   void funcsamp2D_evaluate(const double* x, const double* y, double* out, size_t n)
+//   {
+//       for (size_t k = 0; k < n; k++)
+//           out[k] = pow(fmax(cos(M_PI * (x[k] - 0.5)) * cos(M_PI * (y[k] - 0.5)), 0.0), 8.0);
+//   }
+//
+// To compile and use it:
+// g++ -O3 -shared -fPIC -o myplugin.so myplugin.cpp
+// funcsamp2D --plugin ./myplugin.so halton_base23_owen_1024samples_100sequences.data 1024 100
+//
+
+#ifndef FUNCSAMP2D_PLUGIN_H
+#define FUNCSAMP2D_PLUGIN_H
+
+#include <stddef.h>
+
+#define FUNCSAMP2D_PLUGIN_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Must return FUNCSAMP2D_PLUGIN_VERSION
+int funcsamp2D_pluginVersion(void);
+
+// Name of the integrand
+const char* funcsamp2D_name(void);
+
+// Exact integral over the unit square, or NAN to let funcsamp2D integrate numerically
+double funcsamp2D_reference(void);
+
+// Evaluate the integrand at the n points (x[k], y[k]) and store the values in out[k]
+void funcsamp2D_evaluate(const double* x, const double* y, double* out, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+// Types of the plugin functions, for dlsym()
+typedef int (*Funcsamp2DPluginVersionFunc)(void);
+typedef const char* (*Funcsamp2DNameFunc)(void);
+typedef double (*Funcsamp2DReferenceFunc)(void);
+typedef void (*Funcsamp2DEvaluateFunc)(const double* x, const double* y, double* out, size_t n);
+
+#endif